@@ -0,0 +1,370 @@
+#include "../gpsoinn.hxx"
+#include "../graph/graph.hxx"
+#include "../graph/multiset.hxx"
+#include "../sharded.hxx"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Sweeps GPNet training and scoring, multiset and UndirectedGraph and
+// prints one row per measurement, as csv or with --json as json:
+//   bench [--json] [--quick]
+// Times are nanoseconds per operation unless the metric says otherwise.
+
+using namespace GPSOINN;
+
+// Every allocation, Eigen's included, goes through malloc, counted through
+// the entry points of glibc; elsewhere allocations_per_sample is left out.
+namespace {
+std::atomic<size_t> allocations(0);
+}
+
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+
+void *malloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+void *calloc(size_t count, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+void *realloc(void *pointer, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+}
+}
+const bool counts_allocations = true;
+#else
+const bool counts_allocations = false;
+#endif
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct Row {
+    std::string benchmark;
+    std::vector<std::pair<std::string, std::string>> parameters;
+    std::string metric;
+    double value;
+};
+
+class Report {
+  public:
+    explicit Report(bool json) : m_json(json) {}
+
+    // the rows of one configuration share its parameters
+    void parameters(std::string benchmark,
+                    std::vector<std::pair<std::string, std::string>> values) {
+        m_benchmark = std::move(benchmark);
+        m_parameters = std::move(values);
+    }
+    void add(const std::string &metric, double value) {
+        m_rows.push_back({m_benchmark, m_parameters, metric, value});
+    }
+
+    void print(std::ostream &out) const;
+
+  private:
+    bool m_json;
+    std::string m_benchmark;
+    std::vector<std::pair<std::string, std::string>> m_parameters;
+    std::vector<Row> m_rows;
+};
+
+void Report::print(std::ostream &out) const {
+    out.precision(6);
+    if (!m_json) {
+        out << "benchmark,parameters,metric,value\n";
+        for (auto &row : m_rows) {
+            out << row.benchmark << ',';
+            for (size_t i = 0; i != row.parameters.size(); ++i)
+                out << (i ? ";" : "") << row.parameters[i].first << '='
+                    << row.parameters[i].second;
+            out << ',' << row.metric << ',' << row.value << '\n';
+        }
+        return;
+    }
+    out << "[\n";
+    for (size_t r = 0; r != m_rows.size(); ++r) {
+        auto &row = m_rows[r];
+        out << "  {\"benchmark\": \"" << row.benchmark
+            << "\", \"parameters\": {";
+        for (size_t i = 0; i != row.parameters.size(); ++i)
+            out << (i ? ", " : "") << '"' << row.parameters[i].first
+                << "\": \"" << row.parameters[i].second << '"';
+        out << "}, \"metric\": \"" << row.metric << "\", \"value\": "
+            << row.value << (r + 1 != m_rows.size() ? "},\n" : "}\n");
+    }
+    out << "]\n";
+}
+
+// a few gaussian clusters
+std::vector<std::vector<double>> cluster_samples(unsigned dim, size_t count,
+                                                 unsigned seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> normal;
+    std::vector<std::vector<double>> centres(4, std::vector<double>(dim));
+    for (auto &centre : centres)
+        for (auto &x : centre)
+            x = 4 * normal(rng);
+    std::vector<std::vector<double>> samples(count, std::vector<double>(dim));
+    for (size_t i = 0; i != count; ++i)
+        for (unsigned d = 0; d != dim; ++d)
+            samples[i][d] = centres[i % centres.size()][d] + normal(rng);
+    return samples;
+}
+
+void bench_gpnet(Report &report, bool quick) {
+    std::vector<unsigned> dims = {1, 2, 4, 8};
+    std::vector<unsigned> lambdas = {100, 1000};
+    std::vector<unsigned> age_maxes = {25, 100};
+    std::vector<size_t> counts = {2000, 10000};
+    std::vector<double> sigmas = {1e-2, 1e-1};
+    if (quick) {
+        dims = {2, 4};
+        counts = {2000};
+    }
+    const size_t queries = 1000;
+
+    // sigma_2 decides how many nodes the samples make
+    for (unsigned dim : dims)
+        for (size_t count : counts)
+            for (double sigma_2 : sigmas)
+                for (unsigned lambda : lambdas)
+                    for (unsigned age_max : age_maxes) {
+                        std::ostringstream sigma;
+                        sigma << sigma_2;
+                        report.parameters(
+                            "gpnet",
+                            {{"dimension", std::to_string(dim)},
+                             {"samples", std::to_string(count)},
+                             {"sigma_2", sigma.str()},
+                             {"lambda", std::to_string(lambda)},
+                             {"age_max", std::to_string(age_max)}});
+                        auto samples = cluster_samples(dim, count, dim);
+                        GPNet<0> net(dim, lambda, age_max, 1, sigma_2, 1);
+                        net.set_instrumented(true);
+
+                        size_t before = allocations;
+                        auto start = Clock::now();
+                        for (auto &sample : samples)
+                            net.train(sample);
+                        double elapsed = seconds_since(start);
+                        size_t allocated = allocations - before;
+
+                        TrainStats stats = net.stats();
+                        double per_sample = 1e9 / count;
+                        report.add("train_ns", elapsed * per_sample);
+                        report.add("winner_search_ns",
+                                   stats.winner_search * per_sample);
+                        report.add("threshold_ns",
+                                   stats.threshold * per_sample);
+                        report.add("aging_ns", stats.aging * per_sample);
+                        report.add("pruning_ns", stats.pruning * per_sample);
+                        report.add("factorizations_per_sample",
+                                   double(stats.factorizations) / count);
+                        if (counts_allocations)
+                            report.add("allocations_per_sample",
+                                       double(allocated) / count);
+                        report.add("nodes", stats.nodes);
+                        report.add("edges", stats.edges);
+
+                        auto probes = cluster_samples(dim, queries, dim + 100);
+                        // the first call rebuilds the stale local models
+                        start = Clock::now();
+                        net.predict(probes[0]);
+                        report.add("predict_first_ns",
+                                   seconds_since(start) * 1e9);
+                        start = Clock::now();
+                        double sink = 0;
+                        for (auto &probe : probes)
+                            sink += net.predict(probe);
+                        report.add("predict_ns",
+                                   seconds_since(start) * 1e9 / queries);
+
+                        std::vector<double> flat;
+                        for (auto &probe : probes)
+                            flat.insert(flat.end(), probe.begin(), probe.end());
+                        std::vector<double> result(queries);
+                        BatchOptions options;
+                        options.threads = 1;
+                        net.predict_batch(flat.data(), queries, result.data(),
+                                          options);
+                        start = Clock::now();
+                        net.predict_batch(flat.data(), queries, result.data(),
+                                          options);
+                        report.add("predict_batch_ns",
+                                   seconds_since(start) * 1e9 / queries);
+                        if (sink < 0)
+                            std::cerr << sink;
+                    }
+}
+
+// merged every interval samples, timed apart from the training
+void bench_sharded(Report &report, bool quick) {
+    const unsigned dim = 8, shards = 4;
+    const size_t interval = 5000;
+    std::vector<size_t> counts = {10000, 20000};
+    if (quick)
+        counts = {10000};
+    for (size_t count : counts) {
+        report.parameters("sharded",
+                          {{"dimension", std::to_string(dim)},
+                           {"samples", std::to_string(count)},
+                           {"shards", std::to_string(shards)},
+                           {"interval", std::to_string(interval)}});
+        auto samples = cluster_samples(dim, count, dim);
+        ShardedTrainer<GPNet<0>> trainer(
+            shards,
+            [=](unsigned seed) {
+                return std::make_unique<GPNet<0>>(dim, 20000, 50, 1, 1e-6,
+                                                  seed);
+            },
+            1, 0);
+
+        double training = 0, merging = 0;
+        size_t merges = 0;
+        for (size_t begin = 0; begin < count; begin += interval) {
+            std::vector<std::vector<double>> batch(
+                samples.begin() + begin,
+                samples.begin() + std::min(count, begin + interval));
+            auto start = Clock::now();
+            trainer.train(batch);
+            training += seconds_since(start);
+            start = Clock::now();
+            trainer.merge();
+            merging += seconds_since(start);
+            ++merges;
+        }
+        report.add("train_ns", training * 1e9 / count);
+        report.add("merge_ms", merging * 1e3 / merges);
+    }
+}
+
+void bench_multiset(Report &report, bool quick) {
+    std::vector<size_t> sizes = {1000, 10000, 100000};
+    if (quick)
+        sizes = {1000, 10000};
+    for (size_t size : sizes) {
+        report.parameters("multiset", {{"size", std::to_string(size)}});
+        std::mt19937 rng(1);
+        std::vector<int> keys(size);
+        for (auto &key : keys)
+            key = rng();
+
+        multiset<int> set;
+        auto start = Clock::now();
+        for (int key : keys)
+            set.insert(key);
+        report.add("insert_ns", seconds_since(start) * 1e9 / size);
+
+        start = Clock::now();
+        long sum = 0;
+        for (int key : set)
+            sum += key;
+        report.add("iterate_ns", seconds_since(start) * 1e9 / size);
+
+        std::shuffle(keys.begin(), keys.end(), rng);
+        size_t half = size / 2;
+        start = Clock::now();
+        for (size_t i = 0; i != half; ++i)
+            set.erase(keys[i]);
+        report.add("erase_ns", seconds_since(start) * 1e9 / half);
+
+        // into the slots the erases freed
+        start = Clock::now();
+        for (size_t i = 0; i != half; ++i)
+            set.insert(keys[i]);
+        report.add("reinsert_ns", seconds_since(start) * 1e9 / half);
+        if (sum == 1)
+            std::cerr << sum;
+    }
+}
+
+void bench_graph(Report &report, bool quick) {
+    std::vector<size_t> sizes = {1000, 10000, 100000};
+    if (quick)
+        sizes = {1000, 10000};
+    const size_t degree = 4;
+    for (size_t size : sizes) {
+        report.parameters("graph", {{"vertices", std::to_string(size)},
+                                    {"degree", std::to_string(degree)}});
+        std::mt19937 rng(2);
+        std::uniform_int_distribution<size_t> vertex(0, size - 1);
+        UndirectedGraph<size_t, unsigned> graph;
+        for (size_t i = 0; i != size; ++i)
+            graph.insert_vertex(i);
+
+        size_t edges = size * degree / 2;
+        auto start = Clock::now();
+        for (size_t i = 0; i != edges; ++i)
+            graph.insert_edge(vertex(rng), vertex(rng), 0);
+        report.add("insert_edge_ns", seconds_since(start) * 1e9 / edges);
+
+        // ages every edge, as training does to the winner's
+        start = Clock::now();
+        for (auto &node : graph)
+            for (auto &edge : node)
+                ++edge.weight;
+        report.add("iterate_edge_ns",
+                   seconds_since(start) * 1e9 / (2 * edges));
+
+        // the first edge of every other vertex
+        size_t erased = 0;
+        start = Clock::now();
+        for (auto iter = graph.begin(); iter != graph.end(); ++iter)
+            if (iter.index() % 2 && iter->begin() != iter->end()) {
+                graph.erase_after_edge(iter, iter->before_begin());
+                ++erased;
+            }
+        report.add("erase_edge_ns", seconds_since(start) * 1e9 / erased);
+
+        start = Clock::now();
+        size_t pruned = graph.erase_vertex_if(
+            [](auto iter) { return iter.index() % 4 == 0; });
+        report.add("erase_vertex_ns", seconds_since(start) * 1e9 / pruned);
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    bool json = false, quick = false;
+    for (int i = 1; i != argc; ++i) {
+        if (!std::strcmp(argv[i], "--json")) {
+            json = true;
+        } else if (!std::strcmp(argv[i], "--quick")) {
+            quick = true;
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--json] [--quick]\n";
+            return 1;
+        }
+    }
+
+    Report report(json);
+    bench_multiset(report, quick);
+    bench_graph(report, quick);
+    bench_gpnet(report, quick);
+    bench_sharded(report, quick);
+    report.print(std::cout);
+    return 0;
+}
@@ -2,566 +2,967 @@
 #define GPSOINN_HXX
 
 #include "graph/graph.hxx"
+#include "mixture.hxx"
+#include "node_store.hxx"
+#include "search/search.hxx"
+#include "snapshot.hxx"
+#include "thread_pool.hxx"
 
 #include <Eigen/Dense>
 #include <Eigen/StdVector>
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
 #include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
 
 namespace GPSOINN {
 
-template <unsigned dimension> class GPNet {
+// A network frozen for scoring by GPNet::publish. Nothing changes it once
+// published, so any number of threads score it without locks.
+template <int dimension> struct PublishedNet {
+    GaussianMixture<dimension> mixture;
+    // publications before this one
+    size_t epoch;
+
+    double predict(const Eigen::Matrix<double, dimension, 1> &x_vector) const {
+        return mixture.predict(x_vector);
+    }
+};
+
+// What training spent its time on, see BasicGPNet::set_instrumented. The
+// phases are in seconds.
+struct TrainStats {
+    double winner_search = 0;
+    // both thresholds, rebuilding the local gaussians they need included
+    double threshold = 0;
+    // moving the winner and its neighbours and aging the winner's edges, or
+    // inserting the sample as a node
+    double aging = 0;
+    // expiring edges and pruning nodes every lambda samples
+    double pruning = 0;
+    double publishing = 0;
+
+    size_t samples = 0;
+    // Cholesky factorizations of local covariances, scoring included
+    size_t factorizations = 0;
+    size_t inserted_nodes = 0;
+    size_t pruned_nodes = 0;
+    size_t expired_edges = 0;
+    // the network at the time of stats()
+    size_t nodes = 0;
+    size_t edges = 0;
+};
+
+// The network for nodes of Scalar, Dim of them or Eigen::Dynamic for a
+// dimension chosen at run time; GPNet wraps it with its samples. Training
+// runs in Scalar, while scoring batches, the winner search indices and
+// snapshots stay in double.
+template <typename Scalar, int Dim> class BasicGPNet {
+  public:
+    typedef Eigen::Matrix<Scalar, Dim, 1> NodeVector;
+    typedef Eigen::Matrix<Scalar, Dim, Dim> CovMatrix;
+    typedef Eigen::Matrix<double, Dim, Eigen::Dynamic> SampleMatrix;
+
+    // seed places the first nodes, the only random part of training
+    BasicGPNet(Eigen::Index dim, unsigned lambda, unsigned age_max, unsigned k,
+               double sigma_2, unsigned seed);
+    // copies clone the index and start without a thread pool and with the
+    // instrumentation off
+    BasicGPNet(const BasicGPNet &other);
+    BasicGPNet(BasicGPNet &&other) = default;
+    BasicGPNet &operator=(const BasicGPNet &other) {
+        return *this = BasicGPNet(other);
+    }
+    BasicGPNet &operator=(BasicGPNet &&other) = default;
+
+    // dim() values one after another
+    void train(const Scalar *data);
+    // Rebuilds the local models training left stale, like predict_batch,
+    // so neither is thread safe, not even between two readers; servers
+    // score published() instead.
+    double predict(const Scalar *data);
+    // one sample per column
+    Eigen::VectorXd predict_batch(const Eigen::Ref<const SampleMatrix> &samples,
+                                  const BatchOptions &options = BatchOptions());
+    // count samples stored one after another
+    void predict_batch(const double *data, size_t count, double *result,
+                       const BatchOptions &options = BatchOptions());
+
+    Eigen::Index dim() const noexcept { return m_dim; }
+
+    // searches the winners with index instead of scanning every node,
+    // nullptr to go back to the scan
+    void set_index(std::unique_ptr<NeighbourIndex> index);
+
+    // Snapshots, laid out as in snapshot.hxx; MappedNet in mapped.hxx serves
+    // the ones saved with their mixture. Saving to a path writes a file
+    // next to it and renames that over path instead of rewriting path in
+    // place, so a MappedNet still mapping the old file keeps reading it
+    // whole rather than truncated pages.
+    void save(const std::string &path, bool with_mixture = true);
+    void save(std::ostream &out, bool with_mixture = true);
+    // replaces the network, keeping the index and the thread pool; a
+    // network of Eigen::Dynamic takes the dimension of the snapshot
+    void load(const std::string &path);
+    void load(std::istream &in);
+
+    // Reading while training: one thread trains and publishes, any thread
+    // scores what published() returns, which stays valid and unchanged for
+    // as long as it is held.
+    typedef PublishedNet<Dim> Published;
+    void publish();
+    std::shared_ptr<const Published> published() const {
+        return std::atomic_load(&m_published);
+    }
+    // publishes after every samples trained on, 0 for publish() only;
+    // counted like lambda, so lambda publishes each pruned network
+    void set_publish_interval(unsigned samples) {
+        m_publish_interval = samples;
+        m_unpublished = samples ? m_cycles % samples : 0;
+    }
+
+    // replaces the network with the union of shards trained on disjoint
+    // samples, see ShardedTrainer; the network itself may be one of them.
+    // Publishes the result.
+    template <typename Net> void merge(const std::vector<Net *> &shards);
+
+    // Collects TrainStats while on, starting from zero. Off it costs a
+    // branch per phase.
+    void set_instrumented(bool on) {
+        m_stats.reset(on ? new TrainStats() : nullptr);
+    }
+    bool instrumented() const noexcept { return bool(m_stats); }
+    // zeros while off
+    TrainStats stats() const;
+
   private:
-    typedef Eigen::Matrix<double, dimension, 1> NodeVector;
     struct Node {
-        NodeVector vector;
-        size_t win_count;
+        size_t win_count = 0;
+        // stamp of the last move of the vector
+        size_t moved = 0;
+        // the local gaussian of the node, rebuilt lazily once stale
+        Eigen::LLT<CovMatrix> cov_factor;
+        double log_det = 0;
+        size_t built = 0; // 0 for dirty
+        size_t built_degree = 0;
     };
-    typedef std::array<double, dimension> array;
     typedef UndirectedGraph<Node, unsigned, std::less<NodeVector>,
                             Eigen::aligned_allocator<NodeVector>>
         UGraph;
+    typedef typename UGraph::Vertex Vertex;
 
-  public:
-    GPNet(unsigned lambda = 20000, unsigned age_max = 50, unsigned k = 1,
-          double sigma_2 = 1e-6);
-    ~GPNet() {}
-
-    void train(array &data);
-    double predict(array &data);
-
-  private:
     UGraph m_graph;
+    // every edge once, from the lower half, with its ends renumbered from
+    // slots by numbering
+    std::vector<SnapshotEdge>
+    collect_edges(const std::vector<uint64_t> &numbering) const;
+    // an edge aged age1 seen from v1 and age2 seen from v2
+    void insert_edge(size_t v1, size_t v2, unsigned age1, unsigned age2);
     double m_sigma_2;
     unsigned m_local_opt_coeff = 100;
     unsigned m_age_max;
     unsigned m_lambda;
     unsigned m_k;
     unsigned m_cycles = 0;
-    const double m_const_coeff;
+    double m_const_coeff;
+    Eigen::Index m_dim;
 
     std::pair<double, double> threshold(size_t index,
                                         const NodeVector &x_vector);
+
+    // node vectors by slot
+    NodeStore<Dim, Scalar> m_store;
+    void insert_node(const Eigen::Ref<const NodeVector> &vector) {
+        auto iter = m_graph.insert_vertex(Node());
+        m_store.insert(iter.index(), vector);
+        if (m_index)
+            m_index->insert(iter.index(), point(m_store.col(iter.index())));
+    }
+
+    // winner search
+    std::unique_ptr<NeighbourIndex> m_index;
+    std::pair<size_t, size_t>
+    winners(const Eigen::Ref<const NodeVector> &input);
+    // vector in double for the index, valid until the next call
+    Eigen::Matrix<double, Dim, 1> m_point;
+    const double *point(const Eigen::Ref<const NodeVector> &vector) {
+        if constexpr (std::is_same<Scalar, double>::value) {
+            return vector.data();
+        } else {
+            m_point = vector.template cast<double>();
+            return m_point.data();
+        }
+    }
+
+    // local model cache
+    size_t m_moves = 0;
+    bool stale(size_t index) const;
+    void refresh(size_t index);
+    void invalidate(size_t index) { m_graph[index].value().built = 0; }
+    // erases every edge older than m_age_max
+    void expire();
+    // erases the nodes with fewer than m_k edges
+    void prune();
+    void move(size_t index) {
+        m_graph[index].value().moved = ++m_moves;
+        if (m_index)
+            m_index->move(index, point(m_store.col(index)));
+    }
+    double density(const Node &node, NodeVector diff) const;
+
+    // batch scoring
+    GaussianMixture<Dim> m_mixture;
+    bool m_mixture_ready = false;
+    BatchScorer<Dim> m_scorer;
+    const GaussianMixture<Dim> &mixture();
+
+    // the first nodes
+    std::mt19937 m_rng;
+    NodeVector random_vector() {
+        std::uniform_real_distribution<Scalar> uniform(-1, 1);
+        return NodeVector::NullaryExpr(m_dim, [&] { return uniform(m_rng); });
+    }
+
+    // publication
+    std::shared_ptr<const Published> m_published;
+    size_t m_epoch = 0;
+    unsigned m_publish_interval = 0;
+    unsigned m_unpublished = 0;
+
+    // instrumentation, null while off
+    typedef std::chrono::steady_clock Clock;
+    std::unique_ptr<TrainStats> m_stats;
+    // adds the time since start to phase and starts over
+    void lap(double TrainStats::*phase, Clock::time_point &start) {
+        if (!m_stats)
+            return;
+        auto now = Clock::now();
+        m_stats.get()->*phase +=
+            std::chrono::duration<double>(now - start).count();
+        start = now;
+    }
+}; // class BasicGPNet
+
+template <unsigned dimension, typename Scalar = double>
+class GPNet : public BasicGPNet<Scalar, int(dimension)> {
+    typedef BasicGPNet<Scalar, int(dimension)> Base;
+
+  public:
+    typedef std::array<Scalar, dimension> array;
+
+    GPNet(unsigned lambda = 20000, unsigned age_max = 50, unsigned k = 1,
+          double sigma_2 = 1e-6, unsigned seed = std::random_device()())
+        : Base(dimension, lambda, age_max, k, sigma_2, seed) {}
+
+    void train(array &data) { Base::train(data.data()); }
+    double predict(array &data) { return Base::predict(data.data()); }
+}; // class GPNet
+
+// specialization
+template <typename Scalar>
+class GPNet<0, Scalar> : public BasicGPNet<Scalar, Eigen::Dynamic> {
+    typedef BasicGPNet<Scalar, Eigen::Dynamic> Base;
+
+  public:
+    typedef std::vector<Scalar> vector_d;
+
+    GPNet(unsigned dimension = 1, unsigned lambda = 20000,
+          unsigned age_max = 50, unsigned k = 1, double sigma_2 = 1e-6,
+          unsigned seed = std::random_device()())
+        : Base(dimension, lambda, age_max, k, sigma_2, seed) {}
+
+    void train(vector_d &data) { Base::train(data.data()); }
+    double predict(vector_d &data) { return Base::predict(data.data()); }
 }; // class GPNet
 
 } // namespace GPSOINN
 
 namespace GPSOINN {
 
-template <unsigned dimension>
-GPNet<dimension>::GPNet(unsigned lambda, unsigned age_max, unsigned k,
-                        double sigma_2)
-    : m_lambda(lambda), m_age_max(age_max), m_k(k), m_sigma_2(sigma_2),
-      m_const_coeff(std::sqrt(std::pow(2 * M_PI, dimension))) {
-    m_graph.insert_vertex(Node{.vector = NodeVector::Random(), .win_count = 0});
-    m_graph.insert_vertex(Node{.vector = NodeVector::Random(), .win_count = 0});
+template <typename Scalar, int Dim>
+BasicGPNet<Scalar, Dim>::BasicGPNet(Eigen::Index dim, unsigned lambda,
+                                    unsigned age_max, unsigned k,
+                                    double sigma_2, unsigned seed)
+    : m_sigma_2(sigma_2), m_age_max(age_max), m_lambda(lambda), m_k(k),
+      m_const_coeff(std::sqrt(std::pow(2 * M_PI, dim))), m_dim(dim),
+      m_store(dim), m_mixture(dim), m_rng(seed) {
+    insert_node(random_vector());
+    insert_node(random_vector());
+    publish();
 }
 
-template <unsigned dimension> void GPNet<dimension>::train(array &data) {
+template <typename Scalar, int Dim>
+BasicGPNet<Scalar, Dim>::BasicGPNet(const BasicGPNet &other)
+    : m_graph(other.m_graph), m_sigma_2(other.m_sigma_2),
+      m_local_opt_coeff(other.m_local_opt_coeff), m_age_max(other.m_age_max),
+      m_lambda(other.m_lambda), m_k(other.m_k), m_cycles(other.m_cycles),
+      m_const_coeff(other.m_const_coeff), m_dim(other.m_dim),
+      m_store(other.m_store),
+      m_index(other.m_index ? other.m_index->clone() : nullptr),
+      m_point(other.m_point), m_moves(other.m_moves),
+      m_mixture(other.m_mixture), m_mixture_ready(other.m_mixture_ready),
+      m_scorer(other.m_scorer), m_rng(other.m_rng),
+      m_published(std::atomic_load(&other.m_published)),
+      m_epoch(other.m_epoch), m_publish_interval(other.m_publish_interval),
+      m_unpublished(other.m_unpublished) {}
+
+template <typename Scalar, int Dim>
+void BasicGPNet<Scalar, Dim>::train(const Scalar *data) {
     using namespace Eigen;
-    using NodeM = Matrix<double, dimension, Dynamic>;
 
     if (m_graph.vertex_count() < 2) {
-        m_graph.insert_vertex(
-            Node{.vector = NodeVector::Random(), .win_count = 0});
-        m_graph.insert_vertex(
-            Node{.vector = NodeVector::Random(), .win_count = 0});
+        insert_node(random_vector());
+        insert_node(random_vector());
     }
-    std::random_device rand_dev;
-    std::srand(rand_dev());
-
-    typename NodeM::Index min_index, min2_index;
-    Map<NodeVector> input(data.data());
-
-    {
-        // construct the data matrix
-        NodeM nodes(dimension, m_graph.vertex_count());
-
-        size_t col = 0;
-        for (auto &node : m_graph) {
-            nodes.col(col) = node.value().vector;
-            ++col;
-        }
-
-        // find the winner and the second winner
-        RowVectorXd distances =
-            (nodes.colwise() - input).colwise().squaredNorm();
-        distances.minCoeff(&min_index);
-
-        if (min_index == 0) {
-            distances(0) = distances(1);
-            distances.minCoeff(&min2_index);
-            if (min2_index == 0)
-                min2_index = 1;
-        } else {
-            distances(min_index) = distances(min_index - 1);
-            distances.minCoeff(&min2_index);
-            if (min2_index == min_index)
-                ++min2_index;
-        }
+    m_mixture_ready = false;
+    Clock::time_point start;
+    if (m_stats) {
+        ++m_stats->samples;
+        start = Clock::now();
     }
 
-    auto min_iter = m_graph.begin();
-    auto min2_iter = m_graph.begin();
-    for (size_t i = 0; i != min_index; ++i)
-        ++min_iter;
-    for (size_t i = 0; i != min2_index; ++i)
-        ++min2_iter;
+    Map<const NodeVector> input(data, m_dim);
+
+    // find the winner and the second winner
+    auto[min_index, min2_index] = winners(input);
+    auto min_iter = m_graph.get_vertex_iterator(min_index);
+    auto min2_iter = m_graph.get_vertex_iterator(min2_index);
+    lap(&TrainStats::winner_search, start);
 
     auto[threshold1, prob1] = threshold(min_index, input);
     auto[threshold2, prob2] = threshold(min2_index, input);
+    lap(&TrainStats::threshold, start);
 
     if ((prob1 > prob2 && prob1 > threshold1) || prob2 > threshold2) {
         m_graph.insert_edge(min_iter, min2_iter, 0);
+        // the edges of both change, and the winner ages its edges below
+        invalidate(min_index);
+        invalidate(min2_index);
 
         auto &win_count = min_iter->value().win_count;
-        NodeVector &winner_vec = min_iter->value().vector;
+        auto winner_vec = m_store.col(min_index);
         ++win_count;
         winner_vec.array() += ((input - winner_vec).array() / (win_count + 1));
+        move(min_index);
 
-        for (auto &edge : *min_iter) {
-            NodeVector &node_vec = m_graph[edge.head].value().vector;
+        // only the edges of the winner age, so only they can expire
+        for (auto edge = min_iter->begin(), pre = min_iter->before_begin();
+             edge != min_iter->end();) {
+            auto node_vec = m_store.col(edge->head);
             node_vec.array() += ((input - node_vec).array() /
                                  m_local_opt_coeff / (win_count + 1));
-            ++edge.weight;
-        }
-
-        for (auto niter = m_graph.cbegin(); niter != m_graph.cend(); ++niter) {
-            for (auto edge = niter->cbegin(), pre = niter->cbefore_begin();
-                 edge != niter->cend();) {
-                if (edge->weight > m_age_max) {
-                    edge = m_graph.erase_after_edge(niter, pre);
-                } else {
-                    ++edge;
-                    ++pre;
-                }
+            move(edge->head);
+            if (++edge->weight > m_age_max) {
+                invalidate(edge->head);
+                edge = m_graph.erase_after_edge(min_iter, pre);
+                if (m_stats)
+                    ++m_stats->expired_edges;
+            } else {
+                ++edge;
+                ++pre;
             }
         }
     } else {
-        m_graph.insert_vertex(Node{.vector = input, .win_count = 0});
+        insert_node(input);
+        if (m_stats)
+            ++m_stats->inserted_nodes;
     }
+    lap(&TrainStats::aging, start);
 
     ++m_cycles;
     if (m_cycles == m_lambda) {
         m_cycles = 0;
-        for (auto iter = m_graph.cbegin(); iter != m_graph.cend();) {
-            if (std::distance(iter->cbegin(), iter->cend()) < m_k)
-                iter = m_graph.erase_vertex(iter);
-            else
-                ++iter;
-        }
+        expire();
+        prune();
+        lap(&TrainStats::pruning, start);
     }
-} // namespace GPSOINN
-
-template <unsigned dimension>
-std::pair<double, double>
-GPNet<dimension>::threshold(size_t index, const NodeVector &x_vector) {
-    using namespace Eigen;
-
-    Matrix<double, dimension, dimension> local_cov;
-    local_cov.setZero();
-    auto iter = m_graph.begin();
-    for (size_t i = 0; i != index; ++i)
-        ++iter;
-
-    NodeVector &winner_vec = iter->value().vector;
-    size_t win_sum = 0;
-    size_t neighbour_cnt = 0;
-    for (auto edge : *iter) {
-        NodeVector &node_vec = m_graph[edge.head].value().vector;
-        local_cov.array() +=
-            ((node_vec - winner_vec) * (node_vec - winner_vec).transpose())
-                .array() *
-            edge.weight;
-        win_sum += edge.weight;
-        ++neighbour_cnt;
+    if (m_publish_interval && ++m_unpublished == m_publish_interval) {
+        m_unpublished = 0;
+        publish();
+        lap(&TrainStats::publishing, start);
     }
-    if (win_sum)
-        local_cov.array() /= win_sum;
-    local_cov += MatrixXd::Identity(dimension, dimension) * m_sigma_2;
-
-    // if (neighbour_cnt > dimension) {
-    //     Matrix<bool, dimension, 1> comp;
-    //     SelfAdjointEigenSolver<Matrix<double, dimension, dimension>>
-    //     eigens(local_cov);
-    //     comp = ((eigens.eigenvalues()).array() >=
-    //     m_sigma_2)
-    //                .template cast<bool>();
-
-    //     unsigned count = comp.count();
-    //     Matrix<double, dimension, Dynamic> p_components(dimension, count);
-    //     VectorXd eigenvals(count);
-
-    //     {
-    //         unsigned cnt = 0;
-    //         for (unsigned i = 0; i != dimension; ++i) {
-    //             if (comp(i)) {
-    //                 p_components.col(cnt) =
-    //                 eigens.eigenvectors().col(i); eigenvals(cnt) =
-    //                 eigens.eigenvalues()(i);
-    //                 ++cnt;
-    //             }
-    //         }
-    //     }
-    //     local_cov =
-    //         p_components * eigenvals.asDiagonal() * p_components.transpose()
-    //         + MatrixXd::Identity(dimension, dimension) * m_sigma_2;
-    // }
-
-    SelfAdjointEigenSolver<Matrix<double, dimension, dimension>> eigens(
-        local_cov);
-    double determinant_sqrt = std::sqrt(std::abs(eigens.eigenvalues().prod()));
-    double threshold = 1;
-    Matrix<double, dimension, dimension> cov_inv =
-        eigens.eigenvectors() *
-        eigens.eigenvalues().array().inverse().matrix().asDiagonal() *
-        eigens.eigenvectors().transpose();
-    if (neighbour_cnt) {
-        for (auto edge : *iter) {
-            NodeVector &node_vec = m_graph[edge.head].value().vector;
-            double prob = std::exp(-((x_vector - node_vec).transpose() *
-                                     cov_inv * (x_vector - node_vec))(0) /
-                                   2) /
-                          m_const_coeff / determinant_sqrt;
-
-            if (prob < threshold)
-                threshold = prob;
-        }
-    } else
-        threshold = 0.55;
-
-    double xprob = std::exp(-((x_vector - winner_vec).transpose() * cov_inv *
-                              (x_vector - winner_vec))(0) /
-                            2) /
-                   m_const_coeff / determinant_sqrt;
-    return {
-        threshold,
-        xprob,
-    };
-}
-template <unsigned dimension> double GPNet<dimension>::predict(array &data) {
-    using namespace Eigen;
-
-    Map<NodeVector> input(data.data());
+} // namespace GPSOINN
 
-    double prob = 0;
-    size_t wins = 0;
-    for (auto &node : m_graph) {
-        Matrix<double, dimension, dimension> local_cov;
-        local_cov.setZero();
-        size_t win_sum = 0;
-        for (auto edge : node) {
-            NodeVector &edge_vec = m_graph[edge.head].value().vector;
-            NodeVector &node_vec = node.value().vector;
-            local_cov.array() +=
-                ((edge_vec - node_vec) * (edge_vec - node_vec).transpose())
-                    .array() *
-                edge.weight;
-            win_sum += edge.weight;
+template <typename Scalar, int Dim> void BasicGPNet<Scalar, Dim>::expire() {
+    for (auto niter = m_graph.cbegin(); niter != m_graph.cend(); ++niter) {
+        for (auto edge = niter->cbegin(), pre = niter->cbefore_begin();
+             edge != niter->cend();) {
+            if (edge->weight > m_age_max) {
+                invalidate(niter.index());
+                invalidate(edge->head);
+                edge = m_graph.erase_after_edge(niter, pre);
+                if (m_stats)
+                    ++m_stats->expired_edges;
+            } else {
+                ++edge;
+                ++pre;
+            }
         }
-        if (win_sum)
-            local_cov.array() /= win_sum;
-        local_cov += MatrixXd::Identity(dimension, dimension) * m_sigma_2;
-
-        SelfAdjointEigenSolver<Matrix<double, dimension, dimension>> eigens(
-            local_cov);
-        double determinant_sqrt = std::sqrt(eigens.eigenvalues().prod());
-        Matrix<double, dimension, dimension> cov_inv =
-            eigens.eigenvectors() *
-            eigens.eigenvalues().array().inverse().matrix().asDiagonal() *
-            eigens.eigenvectors().transpose();
-
-        NodeVector &node_vec = node.value().vector;
-        double xprob = std::exp(-((input - node_vec).transpose() * cov_inv *
-                                  (input - node_vec))(0) /
-                                2) /
-                       m_const_coeff / determinant_sqrt;
-        prob += xprob * node.value().win_count;
-        wins += node.value().win_count;
     }
-
-    if (wins)
-        prob /= wins;
-    return prob;
 }
 
-// specialization
-template <> class GPNet<0> {
-  public:
-    typedef Eigen::Matrix<double, Eigen::Dynamic, 1> NodeVector;
-    struct Node {
-        NodeVector vector;
-        size_t win_count;
-    };
-
-  private:
-    typedef std::vector<double> vector_d;
-    typedef UndirectedGraph<Node, unsigned, std::less<NodeVector>,
-                            Eigen::aligned_allocator<NodeVector>>
-        UGraph;
-
-  public:
-    GPNet(unsigned dimension = 1, unsigned lambda = 20000,
-          unsigned age_max = 50, unsigned k = 1, double sigma_2 = 1e-6);
-    ~GPNet() {}
-
-    void train(vector_d &data);
-    double predict(vector_d &data);
-
-  private:
-    UGraph m_graph;
-    double m_sigma_2;
-    unsigned m_local_opt_coeff = 100;
-    unsigned m_age_max;
-    unsigned m_lambda;
-    unsigned m_k;
-    unsigned m_cycles = 0;
-    double m_const_coeff;
-    unsigned m_dimension;
-
-    std::pair<double, double> threshold(size_t index,
-                                        const NodeVector &x_vector);
-}; // class GPNet
+template <typename Scalar, int Dim> void BasicGPNet<Scalar, Dim>::prune() {
+    size_t pruned = m_graph.erase_vertex_if([this](auto iter) {
+        if (iter->degree() >= m_k)
+            return false;
+        m_store.erase(iter.index());
+        if (m_index)
+            m_index->erase(iter.index());
+        return true;
+    });
+    if (m_stats)
+        m_stats->pruned_nodes += pruned;
+}
 
-GPNet<0>::GPNet(unsigned dimension, unsigned lambda, unsigned age_max,
-                unsigned k, double sigma_2)
-    : m_lambda(lambda), m_age_max(age_max), m_k(k), m_sigma_2(sigma_2),
-      m_const_coeff(std::sqrt(std::pow(2 * M_PI, dimension))),
-      m_dimension(dimension) {
-    m_graph.insert_vertex(
-        Node{.vector = NodeVector::Random(m_dimension, 1), .win_count = 0});
-    m_graph.insert_vertex(
-        Node{.vector = NodeVector::Random(m_dimension, 1), .win_count = 0});
+template <typename Scalar, int Dim>
+TrainStats BasicGPNet<Scalar, Dim>::stats() const {
+    if (!m_stats)
+        return TrainStats();
+    TrainStats stats = *m_stats;
+    stats.nodes = m_graph.vertex_count();
+    // both halves of every edge
+    for (auto &vertex : m_graph)
+        stats.edges += vertex.degree();
+    stats.edges /= 2;
+    return stats;
 }
 
-void GPNet<0>::train(vector_d &data) {
+// Every node of a shard joins the nearest merged node of the other shards
+// if that node would have won it as a sample in its own shard, weighted
+// by win counts, and stays a node of its own otherwise. The edges are
+// those of the shards, one per pair, plus the ones the winner rule draws
+// with each merged node as a sample, and the pruning of lambda goes last.
+// Nothing is random, so the same shards merge the same. Both the join and
+// the links search a kd-tree of the merged nodes instead of scanning them.
+template <typename Scalar, int Dim>
+template <typename Net>
+void BasicGPNet<Scalar, Dim>::merge(const std::vector<Net *> &shards) {
     using namespace Eigen;
-    using NodeM = Matrix<double, Dynamic, Dynamic>;
-
-    if (m_graph.vertex_count() < 2) {
-        m_graph.insert_vertex(
-            Node{.vector = NodeVector::Random(m_dimension, 1), .win_count = 0});
-        m_graph.insert_vertex(
-            Node{.vector = NodeVector::Random(m_dimension, 1), .win_count = 0});
+    const std::vector<BasicGPNet *> nets(shards.begin(), shards.end());
+    const size_t npos = -1;
+    size_t total = 0;
+    for (auto net : nets) {
+        if (net->m_dim != m_dim)
+            throw std::invalid_argument("shard of another dimension");
+        total += net->m_graph.vertex_count();
+    }
+    Matrix<Scalar, Dim, Dynamic> vectors(m_dim, total);
+    struct Merged {
+        size_t win_count;
+        // the first node, deciding what joins
+        size_t shard;
+        size_t slot;
+    };
+    std::vector<Merged> merged;
+    std::vector<std::vector<uint64_t>> ids(nets.size());
+    // The merged nodes a node may join, numbered as the empty graph will
+    // slot them: what a shard adds or joins waits for the next shard, so a
+    // merged node takes at most one node of each shard.
+    KDTreeIndex joined(m_dim);
+    std::vector<size_t> touched;
+
+    for (size_t s = 0; s != nets.size(); ++s) {
+        BasicGPNet &shard = *nets[s];
+        ids[s].assign(shard.m_store.slots(), npos);
+        touched.clear();
+        for (auto iter = shard.m_graph.cbegin(); iter != shard.m_graph.cend();
+             ++iter) {
+            NodeVector vector = shard.m_store.col(iter.index());
+            size_t win_count = iter->value().win_count;
+            size_t nearest = joined.nearest2(point(vector)).first;
+            if (nearest != npos) {
+                Merged &node = merged[nearest];
+                auto[threshold, prob] =
+                    nets[node.shard]->threshold(node.slot, vector);
+                if (prob > threshold) {
+                    Scalar weight = node.win_count + 1;
+                    Scalar other = win_count + 1;
+                    vectors.col(nearest) = (weight * vectors.col(nearest) +
+                                            other * vector) /
+                                           (weight + other);
+                    node.win_count += win_count;
+                    ids[s][iter.index()] = nearest;
+                    joined.erase(nearest);
+                    touched.push_back(nearest);
+                    continue;
+                }
+            }
+            vectors.col(merged.size()) = vector;
+            ids[s][iter.index()] = merged.size();
+            touched.push_back(merged.size());
+            merged.push_back({win_count, s, size_t(iter.index())});
+        }
+        for (auto i : touched)
+            joined.insert(i, point(vectors.col(i)));
     }
-    std::random_device rand_dev;
-    std::srand(rand_dev());
-
-    typename NodeM::Index min_index, min2_index;
-    Map<NodeVector> input(data.data(), m_dimension);
-
-    {
-        // construct the data matrix
-        NodeM nodes(m_dimension, m_graph.vertex_count());
 
-        size_t col = 0;
-        for (auto &node : m_graph) {
-            nodes.col(col) = node.value().vector;
-            ++col;
+    // Ages from either end, as the covariances weigh them. Training ages
+    // the edges of a node by one a win, which the merged network never
+    // does, so the merge ages them instead: the edges of a shard by the
+    // wins the other shards add to the node, in proportion to the wins it
+    // had in the shard, and those of the network, when it is one of the
+    // shards, by every win the others add. Every pair then keeps one edge
+    // with the youngest ages and the edges train would have expired go,
+    // which keeps the graph from growing merge by merge.
+    std::vector<size_t> past(merged.size()), own(merged.size());
+    for (size_t s = 0; s != nets.size(); ++s)
+        if (nets[s] == this)
+            for (auto iter = m_graph.cbegin(); iter != m_graph.cend(); ++iter)
+                past[ids[s][iter.index()]] = iter->value().win_count;
+    std::vector<SnapshotEdge> edges;
+    for (size_t s = 0; s != nets.size(); ++s) {
+        const BasicGPNet &shard = *nets[s];
+        for (auto iter = shard.m_graph.cbegin(); iter != shard.m_graph.cend();
+             ++iter)
+            own[ids[s][iter.index()]] = iter->value().win_count;
+        auto age = [&](uint64_t v, uint64_t age) {
+            uint64_t added = merged[v].win_count - past[v];
+            if (&shard == this)
+                return age + added;
+            return own[v] ? age * added / own[v] : age;
+        };
+        for (auto edge : shard.collect_edges(ids[s])) {
+            uint64_t age1 = age(edge.v1, edge.age1);
+            uint64_t age2 = age(edge.v2, edge.age2);
+            if (edge.v1 == edge.v2 || std::max(age1, age2) > m_age_max)
+                continue;
+            edge.age1 = age1;
+            edge.age2 = age2;
+            if (edge.v1 > edge.v2) {
+                std::swap(edge.v1, edge.v2);
+                std::swap(edge.age1, edge.age2);
+            }
+            edges.push_back(edge);
+        }
+    }
+    std::sort(edges.begin(), edges.end(), [](auto &left, auto &right) {
+        return std::tie(left.v1, left.v2) < std::tie(right.v1, right.v2);
+    });
+    size_t kept = 0;
+    for (size_t i = 0; i != edges.size(); ++i) {
+        if (kept && edges[kept - 1].v1 == edges[i].v1 &&
+            edges[kept - 1].v2 == edges[i].v2) {
+            auto &edge = edges[kept - 1];
+            edge.age1 = std::min(edge.age1, edges[i].age1);
+            edge.age2 = std::min(edge.age2, edges[i].age2);
+        } else {
+            edges[kept++] = edges[i];
         }
+    }
+    edges.resize(kept);
+    m_graph.clear();
+    m_store.clear();
+    if (m_index)
+        m_index->clear();
+    m_moves = 0;
+    for (size_t i = 0; i != merged.size(); ++i) {
+        insert_node(vectors.col(i));
+        m_graph[i].value().win_count = merged[i].win_count;
+    }
+    for (auto &edge : edges)
+        insert_edge(edge.v1, edge.v2, edge.age1, edge.age2);
+
+    // A merged node as a sample wins itself, which always passes the
+    // winner's test, and its nearest node comes second. So the pair links
+    // when the second winner's test of train passes with either node as
+    // the sample, judged on the carried edges.
+    std::vector<std::pair<size_t, size_t>> links;
+    for (size_t i = 0; i != merged.size(); ++i) {
+        NodeVector vector = m_store.col(i);
+        auto[first, second] = joined.nearest2(point(vector));
+        size_t nearest = first != i ? first : second;
+        if (nearest == npos)
+            continue;
+        NodeVector other = m_store.col(nearest);
+        auto[threshold1, prob1] = threshold(i, other);
+        auto[threshold2, prob2] = threshold(nearest, vector);
+        if (prob1 > threshold1 || prob2 > threshold2)
+            links.push_back(std::minmax(i, nearest));
+    }
+    // once per pair, renewing an edge the shards already drew
+    std::sort(links.begin(), links.end());
+    links.erase(std::unique(links.begin(), links.end()), links.end());
+    for (auto[v1, v2] : links) {
+        auto &vertex = m_graph[v1];
+        size_t pos = 0;
+        while (pos != vertex.degree() && vertex[pos].head != v2)
+            ++pos;
+        if (pos != vertex.degree()) {
+            vertex[pos].weight = 0;
+            m_graph[v2][vertex[pos].mate].weight = 0;
+        } else {
+            m_graph.insert_edge(v1, v2, 0);
+        }
+        invalidate(v1);
+        invalidate(v2);
+    }
+    prune();
+    m_cycles = 0;
+    m_mixture_ready = false;
+    set_publish_interval(m_publish_interval);
+    publish();
+}
 
-        // find the winner and the second winner
-        RowVectorXd distances =
-            (nodes.colwise() - input).colwise().squaredNorm();
-        distances.minCoeff(&min_index);
+template <typename Scalar, int Dim>
+void BasicGPNet<Scalar, Dim>::save(const std::string &path,
+                                   bool with_mixture) {
+    std::string temporary = path + ".tmp";
+    std::ofstream out(temporary, std::ios::binary);
+    if (!out)
+        throw std::runtime_error("cannot open " + temporary);
+    try {
+        save(out, with_mixture);
+        out.close();
+        if (!out)
+            throw std::runtime_error("cannot write snapshot");
+    } catch (...) {
+        std::remove(temporary.c_str());
+        throw;
+    }
+    if (std::rename(temporary.c_str(), path.c_str())) {
+        std::remove(temporary.c_str());
+        throw std::runtime_error("cannot replace " + path);
+    }
+}
 
-        if (min_index == 0) {
-            distances(0) = distances(1);
-            distances.minCoeff(&min2_index);
-            if (min2_index == 0)
-                min2_index = 1;
-        } else {
-            distances(min_index) = distances(min_index - 1);
-            distances.minCoeff(&min2_index);
-            if (min2_index == min_index)
-                ++min2_index;
+template <typename Scalar, int Dim>
+std::vector<SnapshotEdge> BasicGPNet<Scalar, Dim>::collect_edges(
+    const std::vector<uint64_t> &numbering) const {
+    std::vector<SnapshotEdge> edges;
+    for (auto iter = m_graph.cbegin(); iter != m_graph.cend(); ++iter) {
+        size_t index = iter.index();
+        for (size_t pos = 0; pos != iter->degree(); ++pos) {
+            const auto &edge = (*iter)[pos];
+            if (edge.head < index || (edge.head == index && edge.mate < pos))
+                continue;
+            edges.push_back({numbering[index], numbering[edge.head],
+                             edge.weight,
+                             m_graph[edge.head][edge.mate].weight});
         }
     }
+    return edges;
+}
 
-    auto min_iter = m_graph.begin();
-    auto min2_iter = m_graph.begin();
-    for (size_t i = 0; i != min_index; ++i)
-        ++min_iter;
-    for (size_t i = 0; i != min2_index; ++i)
-        ++min2_iter;
+template <typename Scalar, int Dim>
+void BasicGPNet<Scalar, Dim>::insert_edge(size_t v1, size_t v2,
+                                          unsigned age1, unsigned age2) {
+    m_graph.insert_edge(v1, v2, age1);
+    // the reverse half went in last
+    auto &other = m_graph[v2];
+    other[other.degree() - 1].weight = age2;
+}
 
-    auto[threshold1, prob1] = threshold(min_index, input);
-    auto[threshold2, prob2] = threshold(min2_index, input);
+template <typename Scalar, int Dim>
+void BasicGPNet<Scalar, Dim>::save(std::ostream &out, bool with_mixture) {
+    SnapshotHeader header = {};
+    std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.version = snapshot_version;
+    header.header_size = sizeof(SnapshotHeader);
+    header.dimension = m_dim;
+    header.nodes = m_graph.vertex_count();
+    header.sigma_2 = m_sigma_2;
+    header.lambda = m_lambda;
+    header.age_max = m_age_max;
+    header.k = m_k;
+    header.local_opt_coeff = m_local_opt_coeff;
+    header.cycles = m_cycles;
+
+    std::vector<uint64_t> numbers(m_store.slots());
+    uint64_t number = 0;
+    for (auto iter = m_graph.cbegin(); iter != m_graph.cend(); ++iter)
+        numbers[iter.index()] = number++;
+    std::vector<SnapshotEdge> edges = collect_edges(numbers);
+    header.edges = edges.size();
+
+    const GaussianMixture<Dim> *mixture =
+        with_mixture ? &this->mixture() : nullptr;
+    if (mixture) {
+        header.components = mixture->size();
+        header.weight_sum = mixture->weight_sum();
+    }
+    snapshot_layout(header);
 
-    if ((prob1 > prob2 && prob1 > threshold1) || prob2 > threshold2) {
-        m_graph.insert_edge(min_iter, min2_iter, 0);
+    auto write = [&out](const void *data, size_t size) {
+        out.write(static_cast<const char *>(data), size);
+    };
+    write(&header, sizeof(header));
+    for (auto iter = m_graph.cbegin(); iter != m_graph.cend(); ++iter)
+        write(point(m_store.col(iter.index())), m_dim * sizeof(double));
+    snapshot_pad(out, header.vectors + header.nodes * m_dim * sizeof(double));
+    for (auto &node : m_graph) {
+        uint64_t win_count = node.value().win_count;
+        write(&win_count, sizeof(win_count));
+    }
+    snapshot_pad(out, header.win_counts + header.nodes * sizeof(uint64_t));
+    write(edges.data(), edges.size() * sizeof(SnapshotEdge));
+    snapshot_pad(out, header.edge_list + edges.size() * sizeof(SnapshotEdge));
+    if (header.components)
+        write(mixture->data(), header.file_size - header.mixture);
+    if (!out)
+        throw std::runtime_error("cannot write snapshot");
+}
 
-        auto &win_count = min_iter->value().win_count;
-        NodeVector &winner_vec = min_iter->value().vector;
-        ++win_count;
-        winner_vec.array() += ((input - winner_vec).array() / (win_count + 1));
+template <typename Scalar, int Dim>
+void BasicGPNet<Scalar, Dim>::load(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("cannot open " + path);
+    load(in);
+}
 
-        for (auto &edge : *min_iter) {
-            NodeVector &node_vec = m_graph[edge.head].value().vector;
-            node_vec.array() += ((input - node_vec).array() /
-                                 m_local_opt_coeff / (win_count + 1));
-            ++edge.weight;
-        }
+template <typename Scalar, int Dim>
+void BasicGPNet<Scalar, Dim>::load(std::istream &in) {
+    SnapshotHeader header;
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)))
+        throw std::runtime_error("not a GPSOINN snapshot");
+    snapshot_check(header, header.file_size);
+    if (Dim != Eigen::Dynamic && header.dimension != uint64_t(Dim))
+        throw std::runtime_error("snapshot of another dimension");
+    if (m_index && m_index->dimension() != header.dimension)
+        throw std::runtime_error("snapshot of another dimension than index");
+    size_t dim = header.dimension;
+
+    // The counts only fit the size the header claims, so they are checked
+    // against what the stream holds when it can seek, and read in chunks
+    // otherwise; everything is read before the network changes.
+    uint64_t remaining = snapshot_remaining(in);
+    if (remaining != uint64_t(-1) &&
+        header.file_size - sizeof(header) > remaining)
+        throw std::runtime_error("truncated snapshot");
+    uint64_t position = sizeof(header);
+    std::vector<double> vectors;
+    snapshot_read(in, position, header.vectors, vectors, header.nodes * dim);
+    std::vector<uint64_t> win_counts;
+    snapshot_read(in, position, header.win_counts, win_counts, header.nodes);
+    std::vector<SnapshotEdge> edges;
+    snapshot_read(in, position, header.edge_list, edges, header.edges);
+    for (auto &edge : edges)
+        if (edge.v1 >= header.nodes || edge.v2 >= header.nodes)
+            throw std::runtime_error("corrupt snapshot");
+    std::shared_ptr<std::vector<double>> mixture;
+    if (header.components) {
+        mixture = std::make_shared<std::vector<double>>();
+        snapshot_read(in, position, header.mixture, *mixture,
+                      (header.file_size - header.mixture) / sizeof(double));
+    }
 
-        for (auto niter = m_graph.cbegin(); niter != m_graph.cend(); ++niter) {
-            for (auto edge = niter->cbegin(), pre = niter->cbefore_begin();
-                 edge != niter->cend();) {
-                if (edge->weight > m_age_max) {
-                    edge = m_graph.erase_after_edge(niter, pre);
-                } else {
-                    ++edge;
-                    ++pre;
-                }
-            }
-        }
-    } else {
-        m_graph.insert_vertex(Node{.vector = input, .win_count = 0});
+    if (Eigen::Index(dim) != m_dim) {
+        m_dim = dim;
+        m_const_coeff = std::sqrt(std::pow(2 * M_PI, dim));
+        m_store = NodeStore<Dim, Scalar>(dim);
+        m_mixture = GaussianMixture<Dim>(dim);
+    }
+    m_sigma_2 = header.sigma_2;
+    m_lambda = header.lambda;
+    m_age_max = header.age_max;
+    m_k = header.k;
+    m_local_opt_coeff = header.local_opt_coeff;
+    m_cycles = header.cycles;
+    m_moves = 0;
+
+    m_graph.clear();
+    m_store.clear();
+    if (m_index)
+        m_index->clear();
+    // dense numbers are the slots of an empty graph
+    typedef Eigen::Matrix<double, Dim, 1> Vector;
+    for (size_t i = 0; i != header.nodes; ++i) {
+        insert_node(Eigen::Map<const Vector>(&vectors[i * dim], dim)
+                        .template cast<Scalar>());
+        m_graph[i].value().win_count = win_counts[i];
     }
+    for (auto &edge : edges)
+        insert_edge(edge.v1, edge.v2, edge.age1, edge.age2);
+
+    m_mixture_ready = bool(mixture);
+    if (mixture)
+        m_mixture = GaussianMixture<Dim>::view(dim, header.components,
+                                               header.weight_sum,
+                                               mixture->data(), mixture);
+    set_publish_interval(m_publish_interval);
+    publish();
+}
 
-    ++m_cycles;
-    if (m_cycles == m_lambda) {
-        m_cycles = 0;
-        for (auto iter = m_graph.cbegin(); iter != m_graph.cend();) {
-            if (std::distance(iter->cbegin(), iter->cend()) < m_k)
-                iter = m_graph.erase_vertex(iter);
-            else
-                ++iter;
-        }
+template <typename Scalar, int Dim> void BasicGPNet<Scalar, Dim>::publish() {
+    auto published = std::make_shared<Published>(Published{mixture(), m_epoch});
+    ++m_epoch;
+    std::atomic_store(&m_published,
+                      std::shared_ptr<const Published>(std::move(published)));
+}
+
+template <typename Scalar, int Dim>
+void BasicGPNet<Scalar, Dim>::set_index(
+    std::unique_ptr<NeighbourIndex> index) {
+    if (index && Eigen::Index(index->dimension()) != m_dim)
+        throw std::invalid_argument("index of another dimension");
+    if (index) {
+        index->clear();
+        for (auto iter = m_graph.cbegin(); iter != m_graph.cend(); ++iter)
+            index->insert(iter.index(), point(m_store.col(iter.index())));
     }
-} // namespace GPSOINN
+    m_index = std::move(index);
+}
 
-std::pair<double, double> GPNet<0>::threshold(size_t index,
-                                              const NodeVector &x_vector) {
-    using namespace Eigen;
+template <typename Scalar, int Dim>
+std::pair<size_t, size_t>
+BasicGPNet<Scalar, Dim>::winners(const Eigen::Ref<const NodeVector> &input) {
+    if (m_index)
+        return m_index->nearest2(point(input));
+    auto[min_index, min2_index] = m_store.nearest2(input);
+    return {min_index, min2_index};
+}
 
-    Matrix<double, Dynamic, Dynamic> local_cov(m_dimension, m_dimension);
-    local_cov.setZero();
-    auto iter = m_graph.begin();
-    for (size_t i = 0; i != index; ++i)
-        ++iter;
+template <typename Scalar, int Dim>
+std::pair<double, double>
+BasicGPNet<Scalar, Dim>::threshold(size_t index, const NodeVector &x_vector) {
+    refresh(index);
+    const Vertex &vertex = m_graph[index];
+    const Node &winner = vertex.value();
 
-    NodeVector &winner_vec = iter->value().vector;
-    size_t win_sum = 0;
-    size_t neighbour_cnt = 0;
-    for (auto edge : *iter) {
-        NodeVector &node_vec = m_graph[edge.head].value().vector;
-        local_cov.array() +=
-            ((node_vec - winner_vec) * (node_vec - winner_vec).transpose())
-                .array() *
-            edge.weight;
-        win_sum += edge.weight;
-        ++neighbour_cnt;
-    }
-    if (win_sum)
-        local_cov.array() /= win_sum;
-    local_cov += MatrixXd::Identity(m_dimension, m_dimension) * m_sigma_2;
-
-    // if (neighbour_cnt > m_dimension) {
-    //     Matrix<bool, Dynamic, 1> comp(m_dimension, 1);
-    //     SelfAdjointEigenSolver<Matrix<double, Dynamic, Dynamic>>
-    //     eigens(local_cov);
-    //     comp = ((eigens.eigenvalues()).array() >=
-    //     m_sigma_2)
-    //                .template cast<bool>();
-
-    //     unsigned count = comp.count();
-    //     Matrix<double, Dynamic, Dynamic> p_components(m_dimension, count);
-    //     VectorXd eigenvals(count);
-
-    //     {
-    //         unsigned cnt = 0;
-    //         for (unsigned i = 0; i != m_dimension; ++i) {
-    //             if (comp(i)) {
-    //                 p_components.col(cnt) =
-    //                 eigens.eigenvectors().col(i); eigenvals(cnt) =
-    //                 eigens.eigenvalues()(i);
-    //                 ++cnt;
-    //             }
-    //         }
-    //     }
-    //     local_cov =
-    //         p_components * eigenvals.asDiagonal() * p_components.transpose()
-    //         + MatrixXd::Identity(m_dimension, m_dimension) * m_sigma_2;
-    // }
-
-    SelfAdjointEigenSolver<Matrix<double, Dynamic, Dynamic>> eigens(local_cov);
-    double determinant_sqrt = std::sqrt(eigens.eigenvalues().prod());
     double threshold = 1;
-    Matrix<double, Dynamic, Dynamic> cov_inv =
-        eigens.eigenvectors() *
-        eigens.eigenvalues().array().inverse().matrix().asDiagonal() *
-        eigens.eigenvectors().transpose();
-    if (neighbour_cnt) {
-        for (auto edge : *iter) {
-            NodeVector &node_vec = m_graph[edge.head].value().vector;
-            double prob = std::exp(-((x_vector - node_vec).transpose() *
-                                     cov_inv * (x_vector - node_vec))(0) /
-                                   2) /
-                          m_const_coeff / determinant_sqrt;
-
+    if (vertex.cbegin() != vertex.cend()) {
+        for (auto edge : vertex) {
+            double prob = density(winner, x_vector - m_store.col(edge.head));
             if (prob < threshold)
                 threshold = prob;
         }
     } else
         threshold = 0.55;
 
-    double xprob = std::exp(-((x_vector - winner_vec).transpose() * cov_inv *
-                              (x_vector - winner_vec))(0) /
-                            2) /
-                   m_const_coeff / determinant_sqrt;
     return {
         threshold,
-        xprob,
+        density(winner, x_vector - m_store.col(index)),
     };
 }
-double GPNet<0>::predict(vector_d &data) {
+
+template <typename Scalar, int Dim>
+double BasicGPNet<Scalar, Dim>::predict(const Scalar *data) {
     using namespace Eigen;
 
-    Map<NodeVector> input(data.data(), m_dimension);
+    Map<const NodeVector> input(data, m_dim);
 
     double prob = 0;
     size_t wins = 0;
-    for (auto &node : m_graph) {
-        Matrix<double, Dynamic, Dynamic> local_cov(m_dimension, m_dimension);
-        local_cov.setZero();
-        size_t win_sum = 0;
-        for (auto edge : node) {
-            NodeVector &edge_vec = m_graph[edge.head].value().vector;
-            NodeVector &node_vec = node.value().vector;
-            local_cov.array() +=
-                ((edge_vec - node_vec) * (edge_vec - node_vec).transpose())
-                    .array() *
-                edge.weight;
-            win_sum += edge.weight;
-        }
-        if (win_sum)
-            local_cov.array() /= win_sum;
-        local_cov += MatrixXd::Identity(m_dimension, m_dimension) * m_sigma_2;
-
-        SelfAdjointEigenSolver<Matrix<double, Dynamic, Dynamic>> eigens(
-            local_cov);
-        double determinant_sqrt =
-            std::sqrt(std::abs(eigens.eigenvalues().prod()));
-        Matrix<double, Dynamic, Dynamic> cov_inv =
-            eigens.eigenvectors() *
-            eigens.eigenvalues().array().inverse().matrix().asDiagonal() *
-            eigens.eigenvectors().transpose();
-
-        NodeVector &node_vec = node.value().vector;
-        double xprob = std::exp(-((input - node_vec).transpose() * cov_inv *
-                                  (input - node_vec))(0) /
-                                2) /
-                       m_const_coeff / determinant_sqrt;
-        prob += xprob * node.value().win_count;
-        wins += node.value().win_count;
+    for (auto iter = m_graph.begin(); iter != m_graph.end(); ++iter) {
+        refresh(iter.index());
+        const Node &node = iter->value();
+        prob += density(node, input - m_store.col(iter.index())) *
+                node.win_count;
+        wins += node.win_count;
     }
 
     if (wins)
         prob /= wins;
     return prob;
 }
+
+template <typename Scalar, int Dim>
+Eigen::VectorXd BasicGPNet<Scalar, Dim>::predict_batch(
+    const Eigen::Ref<const SampleMatrix> &samples,
+    const BatchOptions &options) {
+    return m_scorer.predict(mixture(), samples, options);
+}
+
+template <typename Scalar, int Dim>
+void BasicGPNet<Scalar, Dim>::predict_batch(const double *data, size_t count,
+                                            double *result,
+                                            const BatchOptions &options) {
+    m_scorer.predict(mixture(), data, count, result, options);
+}
+
+template <typename Scalar, int Dim>
+void BasicGPNet<Scalar, Dim>::refresh(size_t index) {
+    using namespace Eigen;
+
+    if (!stale(index))
+        return;
+    Vertex &vertex = m_graph[index];
+    Node &node = vertex.value();
+    auto node_vec = m_store.col(index);
+
+    CovMatrix local_cov(m_dim, m_dim);
+    local_cov.setZero();
+    size_t win_sum = 0;
+    for (auto edge : vertex) {
+        NodeVector diff = m_store.col(edge.head) - node_vec;
+        local_cov.template selfadjointView<Lower>().rankUpdate(diff,
+                                                               edge.weight);
+        win_sum += edge.weight;
+    }
+    if (win_sum)
+        local_cov /= Scalar(win_sum);
+    local_cov.diagonal().array() += Scalar(m_sigma_2);
+
+    // only the lower triangle is filled, which is all LLT reads
+    node.cov_factor.compute(local_cov);
+    if (m_stats)
+        ++m_stats->factorizations;
+    node.log_det =
+        2 * double(node.cov_factor.matrixLLT().diagonal().array().log().sum());
+    node.built = m_moves + 1;
+    node.built_degree = vertex.degree();
+}
+
+template <typename Scalar, int Dim>
+bool BasicGPNet<Scalar, Dim>::stale(size_t index) const {
+    // a model goes stale when the node or one of its neighbours moves
+    // after it was built, or when the edges of the node change, which
+    // pruning a neighbour does without invalidating
+    const Vertex &vertex = m_graph[index];
+    const Node &node = vertex.value();
+    if (node.built <= node.moved || vertex.degree() != node.built_degree)
+        return true;
+    for (auto &edge : vertex)
+        if (node.built <= m_graph[edge.head].value().moved)
+            return true;
+    return false;
+}
+
+template <typename Scalar, int Dim>
+double BasicGPNet<Scalar, Dim>::density(const Node &node,
+                                        NodeVector diff) const {
+    // d^T S^-1 d == |L^-1 d|^2 with S = L L^T
+    node.cov_factor.matrixL().solveInPlace(diff);
+    return std::exp(-(double(diff.squaredNorm()) + node.log_det) / 2) /
+           m_const_coeff;
+}
+
+template <typename Scalar, int Dim>
+const GaussianMixture<Dim> &BasicGPNet<Scalar, Dim>::mixture() {
+    if (m_mixture_ready)
+        return m_mixture;
+
+    size_t count = 0;
+    for (auto &node : m_graph)
+        if (node.value().win_count)
+            ++count;
+    // nodes that never won carry no weight
+    m_mixture.resize(count);
+    size_t index = 0;
+    for (auto iter = m_graph.begin(); iter != m_graph.end(); ++iter) {
+        if (!iter->value().win_count)
+            continue;
+        refresh(iter.index());
+        const Node &node = iter->value();
+        m_mixture.set(index, m_store.col(iter.index()).template cast<double>(),
+                      node.cov_factor.matrixLLT().template cast<double>(),
+                      node.log_det, node.win_count);
+        ++index;
+    }
+    m_mixture_ready = true;
+    return m_mixture;
+}
+
 } // namespace GPSOINN
 
 #endif // GPSOINN_HXX
@@ -0,0 +1,707 @@
+#include "gpsoinn.hxx"
+#include "mapped.hxx"
+#include "sharded.hxx"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace GPSOINN;
+
+namespace {
+
+// the same stream of samples for every network
+template <typename Net, typename Sample>
+void train(Net &net, Sample &sample, size_t count, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> normal;
+    for (size_t i = 0; i != count; ++i) {
+        for (auto &x : sample)
+            x = normal(rng);
+        net.train(sample);
+    }
+}
+
+template <typename Net, typename Sample>
+void expect_same(Net &net, Net &other, Sample &sample) {
+    std::mt19937 rng(7);
+    std::normal_distribution<double> normal;
+    for (size_t i = 0; i != 100; ++i) {
+        for (auto &x : sample)
+            x = normal(rng);
+        double expected = net.predict(sample);
+        EXPECT_NEAR(expected, other.predict(sample), expected * 1e-9);
+    }
+}
+
+std::string temp_path(const char *name) {
+    return ::testing::TempDir() + name;
+}
+
+std::vector<std::array<double, 2>> ellipse_samples(size_t count) {
+    std::mt19937 rng(10);
+    std::normal_distribution<double> normal;
+    std::vector<std::array<double, 2>> samples(count);
+    for (auto &sample : samples)
+        sample = {normal(rng), normal(rng) / 2};
+    return samples;
+}
+
+// reads bytes but cannot seek, like a pipe
+struct PipeBuffer : std::streambuf {
+    explicit PipeBuffer(std::string &bytes) {
+        setg(&bytes[0], &bytes[0], &bytes[0] + bytes.size());
+    }
+};
+
+std::unique_ptr<GPNet<2>> make_net(unsigned seed) {
+    return std::make_unique<GPNet<2>>(200, 30, 1, 1e-4, seed);
+}
+
+} // namespace
+
+TEST(NodeStore, nearest2) {
+    typedef NodeStore<1>::NodeVector Vector;
+    typedef std::pair<Eigen::Index, Eigen::Index> Pair;
+    NodeStore<1> store;
+    Vector query(0.0);
+    EXPECT_EQ(Pair(-1, -1), store.nearest2(query));
+
+    double points[] = {3, -1, 2, 1};
+    for (Eigen::Index i = 0; i != 4; ++i)
+        store.insert(i, Vector(points[i]));
+    // 1 and 3 tie, the lower slot wins
+    EXPECT_EQ(Pair(1, 3), store.nearest2(query));
+
+    // free slots hold infinity, also the ones growing skipped over
+    store.erase(1);
+    EXPECT_EQ(Pair(3, 2), store.nearest2(query));
+    store.insert(20, Vector(50.0));
+    EXPECT_EQ(Pair(20, 0), store.nearest2(Vector(100.0)));
+    store.erase(0);
+    store.erase(2);
+    store.erase(3);
+    EXPECT_EQ(Pair(20, -1), store.nearest2(query));
+
+    // a freed slot takes a new vector
+    store.insert(1, Vector(0.5));
+    EXPECT_EQ(Pair(1, 20), store.nearest2(query));
+    EXPECT_EQ(21, store.slots());
+
+    // ties across the chunks of the scan
+    NodeStore<1> many;
+    for (Eigen::Index i = 0; i != 600; ++i)
+        many.insert(i, Vector(i % 300 == 299 ? 1.0 : 2.0));
+    EXPECT_EQ(Pair(299, 599), many.nearest2(query));
+}
+
+TEST(GPNet, roundtrip) {
+    GPNet<3> net(200, 30, 1, 1e-4, 1);
+    std::array<double, 3> sample;
+    train(net, sample, 3000, 1);
+
+    std::stringstream stream;
+    net.save(stream);
+    GPNet<3> copy(20000, 50, 1, 1);
+    copy.load(stream);
+    expect_same(net, copy, sample);
+
+    // the restored network trains on as the original does, up to the order
+    // the edges are summed in
+    train(net, sample, 1000, 2);
+    train(copy, sample, 1000, 2);
+    expect_same(net, copy, sample);
+}
+
+TEST(GPNet, roundtrip_dynamic) {
+    GPNet<0> net(2, 200, 30, 1, 1e-4, 2);
+    std::vector<double> sample(2);
+    train(net, sample, 3000, 3);
+
+    std::stringstream stream;
+    net.save(stream, false);
+    // takes the dimension of the snapshot
+    GPNet<0> copy(2);
+    copy.load(stream);
+    expect_same(net, copy, sample);
+
+    train(net, sample, 1000, 4);
+    train(copy, sample, 1000, 4);
+    expect_same(net, copy, sample);
+}
+
+TEST(GPNet, predict_batch) {
+    GPNet<3> net(200, 30, 1, 1e-4, 8);
+    std::array<double, 3> sample;
+    train(net, sample, 3000, 10);
+
+    // blocks of samples close together let the tolerance skip the nodes
+    // far from all of them
+    Eigen::Matrix3Xd samples = Eigen::Matrix3Xd::Random(3, 1000) * 4;
+    samples.leftCols(500) = Eigen::Matrix3Xd::Random(3, 500) * 0.5;
+    samples.leftCols(500).row(0).array() += 2.5;
+    BatchOptions options;
+    options.threads = 2;
+    Eigen::VectorXd exact = net.predict_batch(samples, options);
+    for (Eigen::Index i = 0; i != samples.cols(); ++i) {
+        Eigen::Vector3d::Map(sample.data()) = samples.col(i);
+        double expected = net.predict(sample);
+        EXPECT_NEAR(exact(i), expected, expected * 1e-12);
+    }
+
+    options.log_density = true;
+    Eigen::VectorXd logs = net.predict_batch(samples, options);
+    for (Eigen::Index i = 0; i != samples.cols(); ++i)
+        EXPECT_NEAR(std::exp(logs(i)), exact(i), exact(i) * 1e-12);
+
+    options.log_density = false;
+    for (double tolerance : {1e-3, 1e-1}) {
+        options.tolerance = tolerance;
+        Eigen::VectorXd pruned = net.predict_batch(samples, options);
+        size_t changed = 0;
+        for (Eigen::Index i = 0; i != samples.cols(); ++i) {
+            EXPECT_NEAR(pruned(i), exact(i), tolerance);
+            changed += pruned(i) != exact(i);
+        }
+        EXPECT_GT(changed, 0u);
+    }
+}
+
+TEST(GPNet, cached_models) {
+    auto samples = ellipse_samples(6000);
+    GPNet<2> net(200, 30, 1, 1e-4, 7);
+    for (size_t begin = 0; begin != samples.size(); begin += 250) {
+        // moves, new edges and expiry between the predictions, which keep
+        // the cached models in use
+        for (size_t i = begin; i != begin + 250; ++i) {
+            net.train(samples[i]);
+            if (i % 50 == 0)
+                net.predict(samples[i]);
+        }
+        // a loaded copy builds every model afresh
+        std::stringstream stream;
+        net.save(stream, false);
+        GPNet<2> copy;
+        copy.load(stream);
+        for (double x = -2; x <= 2; x += 0.5) {
+            std::array<double, 2> sample = {x, x / 4};
+            double expected = copy.predict(sample);
+            EXPECT_NEAR(net.predict(sample), expected, expected * 1e-9);
+        }
+    }
+}
+
+TEST(GPNet, winner_aging) {
+    // with lambda 1 the full sweep of edges runs after every sample, as it
+    // did before only the winner's edges were checked; k 0 keeps the
+    // nodes, so the sweep is all lambda does
+    auto samples = ellipse_samples(5000);
+    GPNet<2> net(5000, 30, 0, 1e-4, 10);
+    GPNet<2> swept(1, 30, 0, 1e-4, 10);
+    net.set_instrumented(true);
+    swept.set_instrumented(true);
+    for (size_t begin = 0; begin != samples.size(); begin += 500) {
+        for (size_t i = begin; i != begin + 500; ++i) {
+            net.train(samples[i]);
+            swept.train(samples[i]);
+        }
+        TrainStats stats = net.stats(), expected = swept.stats();
+        EXPECT_EQ(stats.nodes, expected.nodes);
+        EXPECT_EQ(stats.edges, expected.edges);
+        EXPECT_EQ(stats.expired_edges, expected.expired_edges);
+        for (double x = -2; x <= 2; x += 0.5) {
+            std::array<double, 2> sample = {x, x / 4};
+            double density = swept.predict(sample);
+            EXPECT_NEAR(net.predict(sample), density, density * 1e-9);
+        }
+    }
+    EXPECT_GT(net.stats().expired_edges, 0u);
+}
+
+TEST(GPNet, indices) {
+    auto samples = ellipse_samples(3000);
+    GPNet<2> scan(200, 30, 1, 1e-4, 9);
+    GPNet<2> kdtree(200, 30, 1, 1e-4, 9);
+    GPNet<2> hnsw(200, 30, 1, 1e-4, 9);
+    kdtree.set_index(std::make_unique<KDTreeIndex>(2));
+    hnsw.set_index(std::make_unique<HNSWIndex>(2));
+    for (auto &sample : samples) {
+        scan.train(sample);
+        kdtree.train(sample);
+        hnsw.train(sample);
+    }
+
+    // the exact index picks the winners the scan does; the approximate one
+    // misses a few
+    double distance = 0, total = 0;
+    for (double x = -3; x <= 3; x += 0.25)
+        for (double y = -1.5; y <= 1.5; y += 0.125) {
+            std::array<double, 2> sample = {x, y};
+            double expected = scan.predict(sample);
+            EXPECT_EQ(kdtree.predict(sample), expected);
+            distance += std::abs(hnsw.predict(sample) - expected);
+            total += expected;
+        }
+    EXPECT_LT(distance / total, 0.05);
+}
+
+TEST(GPNet, copy_move) {
+    auto samples = ellipse_samples(4000);
+    GPNet<2> net(200, 30, 1, 1e-4, 11);
+    net.set_index(std::make_unique<KDTreeIndex>(2));
+    net.set_instrumented(true);
+    for (size_t i = 0; i != 2000; ++i)
+        net.train(samples[i]);
+
+    std::vector<std::array<double, 2>> grid;
+    for (double x = -3; x <= 3; x += 0.5)
+        for (double y = -1.5; y <= 1.5; y += 0.25)
+            grid.push_back({x, y});
+    auto predictions = [&grid](GPNet<2> &target) {
+        std::vector<double> result;
+        for (auto &sample : grid)
+            result.push_back(target.predict(sample));
+        return result;
+    };
+
+    GPNet<2> copy(net);
+    auto before = predictions(net);
+    EXPECT_EQ(predictions(copy), before);
+    EXPECT_FALSE(copy.instrumented());
+
+    // the copy trains on its own index; the original stays put
+    for (size_t i = 2000; i != samples.size(); ++i)
+        copy.train(samples[i]);
+    EXPECT_EQ(predictions(net), before);
+    for (size_t i = 2000; i != samples.size(); ++i)
+        net.train(samples[i]);
+    auto after = predictions(net);
+    EXPECT_EQ(predictions(copy), after);
+
+    GPNet<2> moved(std::move(copy));
+    EXPECT_EQ(predictions(moved), after);
+    GPNet<2> assigned;
+    assigned = moved;
+    EXPECT_EQ(predictions(assigned), after);
+    assigned = GPNet<2>(200, 30, 1, 1e-4, 11);
+    EXPECT_NE(predictions(assigned), after);
+}
+
+TEST(GPNet, load_errors) {
+    GPNet<3> net;
+    std::stringstream garbage("not a snapshot at all, not even close to one");
+    EXPECT_THROW(net.load(garbage), std::runtime_error);
+
+    GPNet<0> other(2);
+    std::stringstream stream;
+    other.save(stream);
+    EXPECT_THROW(net.load(stream), std::runtime_error);
+
+    std::string truncated = stream.str();
+    truncated.resize(truncated.size() - 8);
+    std::stringstream short_stream(truncated);
+    GPNet<0> target(2);
+    EXPECT_THROW(target.load(short_stream), std::runtime_error);
+
+    // cycles at or past lambda would stop the pruning
+    std::string bytes = stream.str();
+    SnapshotHeader header;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    for (auto[lambda, cycles] : {std::make_pair(20000u, 20000u),
+                                 std::make_pair(0u, 0u)}) {
+        SnapshotHeader bad = header;
+        bad.lambda = lambda;
+        bad.cycles = cycles;
+        std::memcpy(&bytes[0], &bad, sizeof(bad));
+        std::stringstream corrupt(bytes);
+        EXPECT_THROW(target.load(corrupt), std::runtime_error);
+    }
+}
+
+TEST(GPNet, load_huge_counts) {
+    GPNet<3> net(200, 30, 1, 1e-4, 3);
+    std::array<double, 3> sample;
+    train(net, sample, 500, 4);
+    std::stringstream stream;
+    net.save(stream);
+    std::string bytes = stream.str();
+
+    // a header consistent with itself, counting 2^28 nodes in 256 bytes
+    SnapshotHeader header;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    header.nodes = uint64_t(1) << 28;
+    snapshot_layout(header);
+    std::memcpy(&bytes[0], &header, sizeof(header));
+    bytes.resize(256);
+
+    // rejected before the buffers grow to the counts
+    std::stringstream seekable(bytes);
+    EXPECT_THROW(net.load(seekable), std::runtime_error);
+    PipeBuffer buffer(bytes);
+    std::istream pipe(&buffer);
+    EXPECT_THROW(net.load(pipe), std::runtime_error);
+
+    // the network is left as it was
+    std::stringstream again;
+    net.save(again);
+    EXPECT_EQ(again.str(), stream.str());
+}
+
+TEST(GPNet, float_nodes) {
+    auto samples = ellipse_samples(20000);
+    GPNet<2> net(200, 30, 1, 1e-4, 5);
+    GPNet<0, float> float_net(2, 200, 30, 1, 1e-4, 5);
+    float_net.set_index(std::make_unique<KDTreeIndex>(2));
+    std::vector<float> float_sample(2);
+    for (auto &sample : samples) {
+        net.train(sample);
+        float_sample.assign(sample.begin(), sample.end());
+        float_net.train(float_sample);
+    }
+
+    double distance = 0, total = 0;
+    for (double x = -3; x <= 3; x += 0.25)
+        for (double y = -1.5; y <= 1.5; y += 0.125) {
+            std::array<double, 2> sample = {x, y};
+            float_sample = {float(x), float(y)};
+            double expected = net.predict(sample);
+            distance += std::abs(float_net.predict(float_sample) - expected);
+            total += expected;
+        }
+    EXPECT_LT(distance / total, 0.1);
+
+    // snapshots stay in double
+    std::stringstream stream;
+    float_net.save(stream);
+    GPNet<2> copy;
+    copy.load(stream);
+    std::array<double, 2> sample = {0.5, 0.25};
+    float_sample = {0.5f, 0.25f};
+    EXPECT_NEAR(copy.predict(sample), float_net.predict(float_sample), 1e-4);
+}
+
+TEST(GPNet, publish) {
+    GPNet<3> net(200, 30, 1, 1e-4, 4);
+    net.set_publish_interval(200);
+    std::array<double, 3> sample;
+
+    // readers score whatever is published while the writer trains
+    std::atomic<bool> done(false);
+    std::vector<std::thread> readers;
+    std::vector<size_t> last_epochs(3);
+    for (size_t i = 0; i != last_epochs.size(); ++i)
+        readers.emplace_back([&, i] {
+            std::mt19937 rng(i);
+            std::normal_distribution<double> normal;
+            Eigen::Vector3d x;
+            size_t last = 0;
+            while (!done) {
+                auto published = net.published();
+                EXPECT_GE(published->epoch, last);
+                last = published->epoch;
+                x << normal(rng), normal(rng), normal(rng);
+                double prob = published->predict(x);
+                EXPECT_TRUE(prob >= 0 && std::isfinite(prob));
+            }
+            last_epochs[i] = last;
+        });
+    train(net, sample, 3000, 6);
+    done = true;
+    for (auto &reader : readers)
+        reader.join();
+
+    auto published = net.published();
+    EXPECT_EQ(published->epoch, 15u);
+    for (auto epoch : last_epochs)
+        EXPECT_LE(epoch, 15u);
+    // the last publication is the trained network
+    std::mt19937 rng(8);
+    std::normal_distribution<double> normal;
+    for (size_t i = 0; i != 100; ++i) {
+        for (auto &x : sample)
+            x = normal(rng);
+        double expected = net.predict(sample);
+        EXPECT_NEAR(expected,
+                    published->predict(Eigen::Vector3d::Map(sample.data())),
+                    expected * 1e-9);
+    }
+
+    // held publications outlive the next ones
+    train(net, sample, 10, 9);
+    net.publish();
+    EXPECT_EQ(net.published()->epoch, 16u);
+    EXPECT_EQ(published->epoch, 15u);
+
+    // a merge starts the count over, as it does the cycles
+    GPNet<3> shard(200, 30, 1, 1e-4, 5);
+    train(shard, sample, 500, 10);
+    net.merge(std::vector<GPNet<3> *>{&shard});
+    size_t epoch = net.published()->epoch;
+    train(net, sample, 199, 11);
+    EXPECT_EQ(net.published()->epoch, epoch);
+    train(net, sample, 1, 12);
+    EXPECT_EQ(net.published()->epoch, epoch + 1);
+}
+
+TEST(GPNet, readers) {
+    auto samples = ellipse_samples(2000);
+    GPNet<2> net(200, 30, 1, 1e-4, 14);
+    for (auto &sample : samples)
+        net.train(sample);
+    net.publish();
+
+    // two readers of one idle network score its publication at once
+    auto score = [&net](std::vector<double> &result) {
+        auto published = net.published();
+        for (double x = -3; x <= 3; x += 0.25)
+            for (double y = -1.5; y <= 1.5; y += 0.125)
+                result.push_back(published->predict(Eigen::Vector2d(x, y)));
+    };
+    std::vector<double> first, second;
+    std::thread reader(score, std::ref(first));
+    score(second);
+    reader.join();
+
+    ASSERT_EQ(first.size(), second.size());
+    size_t i = 0;
+    for (double x = -3; x <= 3; x += 0.25)
+        for (double y = -1.5; y <= 1.5; y += 0.125, ++i) {
+            std::array<double, 2> sample = {x, y};
+            double expected = net.predict(sample);
+            EXPECT_EQ(first[i], second[i]);
+            EXPECT_NEAR(first[i], expected, expected * 1e-9);
+        }
+}
+
+TEST(GPNet, instrumentation) {
+    auto samples = ellipse_samples(3000);
+    GPNet<2> net(200, 30, 1, 1e-4, 6);
+    for (size_t i = 0; i != 500; ++i)
+        net.train(samples[i]);
+    EXPECT_FALSE(net.instrumented());
+    EXPECT_EQ(net.stats().samples, 0u);
+
+    net.set_instrumented(true);
+    size_t nodes = net.stats().nodes;
+    for (size_t i = 500; i != samples.size(); ++i)
+        net.train(samples[i]);
+    TrainStats stats = net.stats();
+    EXPECT_EQ(stats.samples, 2500u);
+    EXPECT_GT(stats.winner_search, 0);
+    EXPECT_GT(stats.threshold, 0);
+    EXPECT_GT(stats.aging, 0);
+    EXPECT_GT(stats.pruning, 0);
+    EXPECT_GT(stats.factorizations, 0u);
+    EXPECT_GT(stats.expired_edges, 0u);
+    EXPECT_EQ(stats.nodes, nodes + stats.inserted_nodes - stats.pruned_nodes);
+
+    // as the snapshot counts them
+    std::stringstream stream;
+    net.save(stream, false);
+    SnapshotHeader header;
+    stream.read(reinterpret_cast<char *>(&header), sizeof(header));
+    EXPECT_EQ(stats.nodes, header.nodes);
+    EXPECT_EQ(stats.edges, header.edges);
+
+    net.set_instrumented(false);
+    EXPECT_EQ(net.stats().factorizations, 0u);
+}
+
+TEST(GPNet, merge_links) {
+    auto samples = ellipse_samples(4000);
+    GPNet<2> first(200, 30, 1, 1e-4, 11);
+    GPNet<2> second(200, 30, 1, 1e-4, 12);
+    for (size_t i = 0; i != samples.size(); ++i)
+        (i % 2 ? second : first).train(samples[i]);
+    // an outlier no threshold takes
+    std::array<double, 2> outlier = {50, 50};
+    second.train(outlier);
+
+    GPNet<2> merged(200, 30, 1, 1e-4, 13);
+    merged.merge(std::vector<GPNet<2> *>{&first, &second});
+    std::stringstream stream;
+    merged.save(stream, false);
+    std::string snapshot = stream.str();
+    SnapshotHeader header;
+    std::memcpy(&header, snapshot.data(), sizeof(header));
+    ASSERT_GT(header.edges, 0u);
+
+    // left without edges and pruned, instead of linked to its nearest node
+    auto vectors =
+        reinterpret_cast<const double *>(snapshot.data() + header.vectors);
+    for (size_t i = 0; i != header.nodes; ++i)
+        EXPECT_LT(vectors[2 * i], 10);
+    // shard edges are older from the winner's end, so an edge new from
+    // both ends is one of the merge, and the merge draws one per pair
+    auto edges = reinterpret_cast<const SnapshotEdge *>(snapshot.data() +
+                                                        header.edge_list);
+    std::vector<std::pair<uint64_t, uint64_t>> links;
+    for (size_t i = 0; i != header.edges; ++i)
+        if (!edges[i].age1 && !edges[i].age2)
+            links.push_back(std::minmax(edges[i].v1, edges[i].v2));
+    EXPECT_FALSE(links.empty());
+    std::sort(links.begin(), links.end());
+    EXPECT_EQ(std::adjacent_find(links.begin(), links.end()), links.end());
+
+    // searching through an index links the same
+    GPNet<2> indexed(200, 30, 1, 1e-4, 13);
+    indexed.set_index(std::make_unique<KDTreeIndex>(2));
+    indexed.merge(std::vector<GPNet<2> *>{&first, &second});
+    for (double x = -3; x <= 3; x += 0.5)
+        for (double y = -1.5; y <= 1.5; y += 0.25) {
+            std::array<double, 2> sample = {x, y};
+            EXPECT_EQ(indexed.predict(sample), merged.predict(sample));
+        }
+}
+
+TEST(ShardedTrainer, deterministic) {
+    auto samples = ellipse_samples(12000);
+    ShardedTrainer<GPNet<2>> trainer(4, make_net, 1, 5000);
+    trainer.train(samples);
+    trainer.merge();
+
+    // in other batches
+    ShardedTrainer<GPNet<2>> other(4, make_net, 1, 5000);
+    for (size_t begin = 0; begin != samples.size(); begin += 1500) {
+        std::vector<std::array<double, 2>> batch(samples.begin() + begin,
+                                                 samples.begin() + begin +
+                                                     1500);
+        other.train(batch);
+    }
+    other.merge();
+
+    EXPECT_EQ(trainer.network().published()->epoch, 3u);
+    // the shards started over, and there is nothing new to merge
+    std::array<double, 2> origin = {0, 0};
+    EXPECT_EQ(trainer.shard(0).predict(origin), 0);
+    trainer.merge();
+    EXPECT_EQ(trainer.network().published()->epoch, 3u);
+    for (double x = -3; x <= 3; x += 0.5)
+        for (double y = -1.5; y <= 1.5; y += 0.25) {
+            std::array<double, 2> sample = {x, y};
+            EXPECT_EQ(trainer.network().predict(sample),
+                      other.network().predict(sample));
+        }
+}
+
+TEST(ShardedTrainer, bounded_edges) {
+    ShardedTrainer<GPNet<2>> trainer(4, make_net, 3, 2000);
+    trainer.network().set_instrumented(true);
+    std::mt19937 rng(4);
+    std::normal_distribution<double> normal;
+    std::vector<std::array<double, 2>> samples(2000);
+    // carried edges age and collapse instead of piling up merge by merge
+    size_t edges = 0;
+    for (size_t merge = 1; merge <= 40; ++merge) {
+        for (auto &sample : samples)
+            sample = {normal(rng), normal(rng) / 2};
+        trainer.train(samples);
+        if (merge == 10)
+            edges = trainer.network().stats().edges;
+    }
+    ASSERT_GT(edges, 0u);
+    EXPECT_LT(trainer.network().stats().edges, edges * 3 / 2);
+}
+
+TEST(ShardedTrainer, close_to_single) {
+    auto samples = ellipse_samples(40000);
+    ShardedTrainer<GPNet<2>> trainer(4, make_net, 2, 5000);
+    trainer.train(samples);
+    auto single = make_net(2);
+    for (auto &sample : samples)
+        single->train(sample);
+
+    // the l1 distance of the densities relative to the total
+    double distance = 0, total = 0;
+    for (double x = -3; x <= 3; x += 0.25)
+        for (double y = -1.5; y <= 1.5; y += 0.125) {
+            std::array<double, 2> sample = {x, y};
+            double expected = single->predict(sample);
+            distance += std::abs(trainer.network().predict(sample) - expected);
+            total += expected;
+        }
+    EXPECT_LT(distance / total, 0.3);
+}
+
+TEST(MappedNet, predict) {
+    GPNet<3> net(200, 30, 1, 1e-4, 3);
+    std::array<double, 3> sample;
+    train(net, sample, 3000, 5);
+    std::string path = temp_path("gpsoinn_mapped_test.snapshot");
+    net.save(path);
+
+    Eigen::Matrix3Xd samples = Eigen::Matrix3Xd::Random(3, 500) * 2;
+    BatchOptions options;
+    options.threads = 2;
+    Eigen::VectorXd expected = net.predict_batch(samples, options);
+    {
+        MappedNet<3> mapped(path);
+        EXPECT_GT(mapped.header().components, 0u);
+        EXPECT_GT(mapped.header().edges, 0u);
+        Eigen::VectorXd result = mapped.predict_batch(samples, options);
+        for (Eigen::Index i = 0; i != samples.cols(); ++i)
+            EXPECT_EQ(expected(i), result(i));
+        EXPECT_DOUBLE_EQ(mapped.predict(samples.col(0)), expected(0));
+
+        // samples strided through a taller matrix
+        Eigen::MatrixXd tall = Eigen::MatrixXd::Random(6, 300) * 2;
+        Eigen::Matrix3Xd dense = tall.topRows(3);
+        Eigen::VectorXd strided =
+            mapped.predict_batch(tall.topRows(3), options);
+        Eigen::VectorXd contiguous = mapped.predict_batch(dense, options);
+        for (Eigen::Index i = 0; i != dense.cols(); ++i)
+            EXPECT_EQ(strided(i), contiguous(i));
+    }
+    {
+        MappedNet<Eigen::Dynamic> mapped(path);
+        EXPECT_EQ(mapped.dim(), 3);
+        Eigen::VectorXd result = mapped.predict_batch(samples, options);
+        for (Eigen::Index i = 0; i != samples.cols(); ++i)
+            EXPECT_NEAR(expected(i), result(i), expected(i) * 1e-9);
+    }
+    EXPECT_THROW(MappedNet<2> wrong(path), std::runtime_error);
+
+    // saving over a mapped snapshot leaves the mapping whole
+    {
+        MappedNet<3> mapped(path);
+        GPNet<3> other(200, 30, 1, 1e-4, 4);
+        train(other, sample, 1000, 6);
+        other.save(path);
+        Eigen::VectorXd result = mapped.predict_batch(samples, options);
+        for (Eigen::Index i = 0; i != samples.cols(); ++i)
+            EXPECT_EQ(expected(i), result(i));
+        MappedNet<3> replaced(path);
+        Eigen::VectorXd replacing = other.predict_batch(samples, options);
+        result = replaced.predict_batch(samples, options);
+        for (Eigen::Index i = 0; i != samples.cols(); ++i)
+            EXPECT_EQ(replacing(i), result(i));
+    }
+
+    net.save(path, false);
+    EXPECT_THROW(MappedNet<3> bare(path), std::runtime_error);
+
+    // a count that wraps the layout around to the size of the bare file
+    std::stringstream stream;
+    net.save(stream, false);
+    std::string bytes = stream.str();
+    SnapshotHeader header;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    header.components = uint64_t(1) << 61;
+    snapshot_layout(header);
+    ASSERT_EQ(bytes.size(), header.file_size);
+    std::memcpy(&bytes[0], &header, sizeof(header));
+    std::ofstream(path, std::ios::binary) << bytes;
+    EXPECT_THROW(MappedNet<3> wrapped(path), std::runtime_error);
+    std::stringstream crafted(bytes);
+    GPNet<3> target;
+    EXPECT_THROW(target.load(crafted), std::runtime_error);
+    std::remove(path.c_str());
+}
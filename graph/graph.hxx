@@ -4,10 +4,11 @@
 #include "multiset.hxx"
 
 #include <algorithm>
-#include <forward_list>
 #include <functional>
-#include <unordered_set>
+#include <iterator>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 namespace GPSOINN {
 
@@ -21,49 +22,131 @@ class Digraph {
     friend void swap(Digraph &left, Digraph &right) noexcept {
         using std::swap;
         swap(left.vertices, right.vertices);
+        swap(left.spare_edges, right.spare_edges);
+        swap(left.spare_in_edges, right.spare_in_edges);
+        swap(left.paired, right.paired);
     }
 
     // edge node
+    // mate is the position of the edge seen from its head: the paired edge
+    // in the edges of the head for an undirected graph, the entry in the
+    // in-edges of the head otherwise
     struct EdgeNode {
         WeightT weight;
         index_t head;
+        index_t mate;
     };
 
-    typedef typename std::forward_list<EdgeNode>::iterator edge_iterator;
-    typedef typename std::forward_list<EdgeNode>::const_iterator
-        const_edge_iterator;
+    // an edge seen from its head, pos being its position at the tail
+    struct EdgeRef {
+        index_t tail;
+        index_t pos;
+    };
+
+    // class EdgeIterator
+    // an edge by its position in the edges of its tail, so it stays valid
+    // while edges are added; erase_after_edge moves the last edge of the
+    // tail into the gap and end() moves with it
+    template <bool Const> class EdgeIterator {
+        template <bool> friend class EdgeIterator;
+        typedef typename std::conditional<Const, const std::vector<EdgeNode>,
+                                          std::vector<EdgeNode>>::type
+            edges_type;
+
+      public:
+        friend bool operator==(const EdgeIterator &lhs,
+                               const EdgeIterator &rhs) {
+            return lhs.pos == rhs.pos && lhs.edges == rhs.edges;
+        }
+        friend bool operator!=(const EdgeIterator &lhs,
+                               const EdgeIterator &rhs) {
+            return !(lhs == rhs);
+        }
+
+        typedef std::ptrdiff_t difference_type;
+        typedef EdgeNode value_type;
+        typedef typename std::conditional<Const, const EdgeNode *,
+                                          EdgeNode *>::type pointer;
+        typedef typename std::conditional<Const, const EdgeNode &,
+                                          EdgeNode &>::type reference;
+        typedef std::forward_iterator_tag iterator_category;
+
+        EdgeIterator() : edges(nullptr), pos(0) {}
+        // pos -1 for before the beginning
+        EdgeIterator(edges_type *edges, index_t pos) : edges(edges), pos(pos) {}
+        // iterator to const_iterator
+        template <bool Other,
+                  typename = typename std::enable_if<Const && !Other>::type>
+        EdgeIterator(const EdgeIterator<Other> &other)
+            : edges(other.edges), pos(other.pos) {}
+
+        // dereference
+        reference operator*() const { return (*edges)[pos]; }
+        pointer operator->() const { return &(*edges)[pos]; }
+        // increment
+        EdgeIterator &operator++() {
+            ++pos;
+            return *this;
+        }
+        EdgeIterator operator++(int) {
+            EdgeIterator previous = *this;
+            ++pos;
+            return previous;
+        }
+
+        index_t index() const noexcept { return pos; }
+
+      private:
+        edges_type *edges;
+        index_t pos;
+    };
+
+    typedef EdgeIterator<false> edge_iterator;
+    typedef EdgeIterator<true> const_edge_iterator;
 
     // class Vertex
     class Vertex {
         friend Digraph;
 
       public:
-        edge_iterator begin() noexcept { return edges.begin(); }
+        edge_iterator begin() noexcept { return {&edges, 0}; }
 
-        const_edge_iterator begin() const noexcept { return edges.cbegin(); }
+        const_edge_iterator begin() const noexcept { return {&edges, 0}; }
 
-        const_edge_iterator cbegin() const noexcept { return edges.cbegin(); }
-        edge_iterator end() noexcept { return edges.end(); }
+        const_edge_iterator cbegin() const noexcept { return {&edges, 0}; }
+        edge_iterator end() noexcept { return {&edges, edges.size()}; }
 
-        const_edge_iterator end() const noexcept { return edges.cend(); }
+        const_edge_iterator end() const noexcept {
+            return {&edges, edges.size()};
+        }
 
-        const_edge_iterator cend() const noexcept { return edges.cend(); }
-        edge_iterator before_begin() noexcept { return edges.before_begin(); }
+        const_edge_iterator cend() const noexcept {
+            return {&edges, edges.size()};
+        }
+        edge_iterator before_begin() noexcept { return {&edges, index_t(-1)}; }
 
         const_edge_iterator before_begin() const noexcept {
-            return edges.cbefore_begin();
+            return {&edges, index_t(-1)};
         }
 
         const_edge_iterator cbefore_begin() const noexcept {
-            return edges.cbefore_begin();
+            return {&edges, index_t(-1)};
         }
 
+        // the number of edges going out
+        index_t degree() const noexcept { return edges.size(); }
+        // edge by position, as in EdgeNode::mate
+        EdgeNode &operator[](index_t pos) { return edges[pos]; }
+        const EdgeNode &operator[](index_t pos) const { return edges[pos]; }
+
         ValueT &value() { return val; }
         const ValueT &value() const { return val; }
 
       private:
         ValueT val;
-        std::forward_list<EdgeNode> edges;
+        std::vector<EdgeNode> edges;
+        // empty when the edges are paired
+        std::vector<EdgeRef> in_edges;
     };
 
     // loads of typedefs
@@ -88,7 +171,7 @@ class Digraph {
 
     /* operators */
     Digraph &operator=(Digraph other) {
-        std::swap(*this, other);
+        swap(*this, other);
         return *this;
     }
 
@@ -99,17 +182,21 @@ class Digraph {
     vertex_iterator insert_vertex(const ValueT &value) {
         Vertex vertex;
         vertex.val = value;
-        return vertices.insert(vertex);
+        return reuse(vertices.insert(vertex));
     }
     vertex_iterator insert_vertex(ValueT &&value) {
         Vertex vertex;
         vertex.val = value;
-        return vertices.insert(std::move(vertex));
+        return reuse(vertices.insert(std::move(vertex)));
     }
+    // O(degree)
     vertex_iterator erase_vertex(const_vertex_iterator pos);
     vertex_iterator erase_vertex(const_vertex_iterator beg,
                                  const_vertex_iterator end);
     size_type erase_vertex(const ValueT &key);
+    // erases every vertex pred(const_vertex_iterator) holds for in one pass
+    // over the edges; pred is called once per vertex in index order
+    template <typename Predicate> size_type erase_vertex_if(Predicate pred);
 
     // edge related modifiers
     void insert_edge(const_vertex_iterator tail, const_vertex_iterator head,
@@ -158,12 +245,40 @@ class Digraph {
   protected:
     set_type vertices;
 
+    // for UndirectedGraph: every edge has a reverse one in the edges of its
+    // head and erasing one erases both
+    Digraph(const Compare &comp, const Allocator &alloc, bool paired)
+        : vertices(comp, alloc), paired(paired) {}
+    void insert_paired_edge(index_t v1, index_t v2, const WeightT &weight);
+
   private:
+    // edge lists of erased vertices kept for new ones
+    static constexpr size_type max_spare = 64;
+    std::vector<std::vector<EdgeNode>> spare_edges;
+    std::vector<std::vector<EdgeRef>> spare_in_edges;
+    bool paired = false;
+
     inline typename set_type::iterator
     iter_remove_c(typename set_type::const_iterator citer) {
         index_t tail_pos = citer.index();
         return vertices.get_iterator(tail_pos);
     }
+    index_t slot_count() const noexcept {
+        auto end = vertices.cend();
+        return end.index();
+    }
+
+    vertex_iterator reuse(vertex_iterator vertex);
+    void recycle(Vertex &vertex);
+
+    // removes edge pos of tail together with whatever points back at it
+    void erase_edge(index_t tail, index_t pos);
+    // swap removals fixing up the mate of the moved element
+    void unlink(index_t tail, index_t pos);
+    void unlink_in_edge(index_t head, index_t pos);
+    // tells the mate of edge pos of tail where it is now
+    void relink(index_t tail, index_t pos);
+    void erase_marked(const std::vector<bool> &marked);
 };
 template <typename ValueT, typename WeightT,
           typename Compare = std::less<ValueT>,
@@ -189,7 +304,8 @@ class UndirectedGraph : public Digraph<ValueT, WeightT, Compare, Allocator> {
 
     // constructors
     UndirectedGraph() : UndirectedGraph(Compare()) {}
-    explicit UndirectedGraph(const Compare &comp) : Digraph(comp) {}
+    explicit UndirectedGraph(const Compare &comp)
+        : Digraph(comp, Allocator(), true) {}
     UndirectedGraph(const UndirectedGraph &other) = default;
     UndirectedGraph(UndirectedGraph &&other) = default;
 
@@ -206,7 +322,7 @@ class UndirectedGraph : public Digraph<ValueT, WeightT, Compare, Allocator> {
 
     // operator=
     UndirectedGraph &operator=(UndirectedGraph other) {
-        std::swap(*this, other);
+        swap(*this, other);
         return *this;
     }
 
@@ -224,19 +340,23 @@ class UndirectedGraph : public Digraph<ValueT, WeightT, Compare, Allocator> {
     size_type erase_vertex(const ValueT &key) {
         return Digraph::erase_vertex(key);
     }
+    template <typename Predicate> size_type erase_vertex_if(Predicate pred) {
+        return Digraph::erase_vertex_if(pred);
+    }
 
     // edge related modifiers
     void insert_edge(const_vertex_iterator v1, const_vertex_iterator v2,
                      const WeightT &weight = 0) {
-        Digraph::insert_edge(v1, v2, weight);
-        Digraph::insert_edge(v2, v1, weight);
+        Digraph::insert_paired_edge(v1.index(), v2.index(), weight);
     }
     void insert_edge(index_t v1, index_t v2, const WeightT &weight = 1) {
-        Digraph::insert_edge(v1, v2, weight);
-        Digraph::insert_edge(v2, v1, weight);
+        Digraph::insert_paired_edge(v1, v2, weight);
     }
+    // erases the reverse edge as well
     edge_iterator erase_after_edge(const_vertex_iterator v1,
-                                   const_edge_iterator edge);
+                                   const_edge_iterator edge) {
+        return Digraph::erase_after_edge(v1, edge);
+    }
 
     // iterator related
     vertex_iterator begin() noexcept { return Digraph::begin(); }
@@ -283,19 +403,26 @@ Digraph<ValueT, WeightT, Compare, Allocator>::erase_vertex(
     const_vertex_iterator pos) {
     typename set_type::const_iterator &iter = pos;
     auto index = iter.index();
-    auto result = vertices.erase(iter);
-    for (auto &vertex : vertices) {
-        auto pre = vertex.edges.cbefore_begin();
-        for (auto edge = vertex.edges.cbegin(); edge != vertex.edges.cend();) {
-            if (edge->head == index) {
-                edge = vertex.edges.erase_after(pre);
-            } else {
-                ++edge;
-                ++pre;
-            }
-        }
+    Vertex &vertex = vertices[index];
+
+    // the mates are read afresh as unlinking may move them
+    for (index_t i = 0; i != vertex.edges.size(); ++i) {
+        const EdgeNode &edge = vertex.edges[i];
+        if (edge.head == index)
+            continue;
+        if (paired)
+            unlink(edge.head, edge.mate);
+        else
+            unlink_in_edge(edge.head, edge.mate);
+    }
+    for (index_t i = 0; i != vertex.in_edges.size(); ++i) {
+        const EdgeRef &ref = vertex.in_edges[i];
+        if (ref.tail != index)
+            unlink(ref.tail, ref.pos);
     }
-    return result;
+
+    recycle(vertex);
+    return vertices.erase(iter);
 }
 
 template <typename ValueT, typename WeightT, typename Compare,
@@ -305,50 +432,109 @@ Digraph<ValueT, WeightT, Compare, Allocator>::erase_vertex(
     const_vertex_iterator beg, const_vertex_iterator end) {
     typename set_type::const_iterator &beg_iter = beg;
     typename set_type::const_iterator &end_iter = end;
-    std::unordered_set<index_t> indices;
+    std::vector<bool> marked(slot_count());
     for (auto iter = beg_iter; iter != end_iter; ++iter) {
-        indices.insert(iter.index());
-    }
-    auto result = vertices.erase(beg_iter, end_iter);
-    for (auto &vertex : vertices) {
-        auto pre = vertex.edges.cbefore_begin();
-        for (auto edge = vertex.edges.cbegin(); edge != vertex.edges.cend();) {
-            if (indices.count(edge->head) == 1) {
-                edge = vertex.edges.erase_after(pre);
-            } else {
-                ++edge;
-                ++pre;
-            }
-        }
+        marked[iter.index()] = true;
     }
-    return result;
+    erase_marked(marked);
+    return vertices.get_iterator(end_iter.index());
 }
 template <typename ValueT, typename WeightT, typename Compare,
           typename Allocator>
 typename Digraph<ValueT, WeightT, Compare, Allocator>::size_type
 Digraph<ValueT, WeightT, Compare, Allocator>::erase_vertex(const ValueT &key) {
-    std::unordered_set<index_t> indices;
+    return erase_vertex_if([&key](const_vertex_iterator iter) {
+        return iter->value() == key;
+    });
+}
+
+template <typename ValueT, typename WeightT, typename Compare,
+          typename Allocator>
+template <typename Predicate>
+typename Digraph<ValueT, WeightT, Compare, Allocator>::size_type
+Digraph<ValueT, WeightT, Compare, Allocator>::erase_vertex_if(Predicate pred) {
+    std::vector<bool> marked(slot_count());
+    size_type count = 0;
     for (auto iter = vertices.cbegin(); iter != vertices.cend(); ++iter) {
-        if (iter->value() == key)
-            indices.insert(iter.index());
-    }
-
-    for (auto index : indices)
-        vertices.erase(vertices.get_iterator(index));
-
-    for (auto &vertex : vertices) {
-        auto pre = vertex.edges.cbefore_begin();
-        for (auto edge = vertex.edges.cbegin(); edge != vertex.edges.cend();) {
-            if (indices.count(edge->head) == 1) {
-                edge = vertex.edges.erase_after(pre);
-            } else {
-                ++edge;
-                ++pre;
-            }
+        if (pred(iter)) {
+            marked[iter.index()] = true;
+            ++count;
         }
     }
-    return indices.size();
+    if (count)
+        erase_marked(marked);
+    return count;
 }
+
+template <typename ValueT, typename WeightT, typename Compare,
+          typename Allocator>
+void Digraph<ValueT, WeightT, Compare, Allocator>::erase_marked(
+    const std::vector<bool> &marked) {
+    index_t slots = slot_count();
+
+    // the new positions of the edges that stay, by tail and old position
+    std::vector<index_t> offsets(slots + 1, 0);
+    std::vector<index_t> in_offsets(slots + 1, 0);
+    for (auto iter = vertices.cbegin(); iter != vertices.cend(); ++iter) {
+        offsets[iter.index() + 1] = iter->edges.size();
+        in_offsets[iter.index() + 1] = iter->in_edges.size();
+    }
+    for (index_t i = 0; i != slots; ++i) {
+        offsets[i + 1] += offsets[i];
+        in_offsets[i + 1] += in_offsets[i];
+    }
+    std::vector<index_t> positions(offsets.back());
+    std::vector<index_t> in_positions(in_offsets.back());
+    for (auto iter = vertices.cbegin(); iter != vertices.cend(); ++iter) {
+        index_t index = iter.index();
+        if (marked[index])
+            continue;
+        index_t kept = 0;
+        for (index_t i = 0; i != iter->edges.size(); ++i)
+            if (!marked[iter->edges[i].head])
+                positions[offsets[index] + i] = kept++;
+        kept = 0;
+        for (index_t i = 0; i != iter->in_edges.size(); ++i)
+            if (!marked[iter->in_edges[i].tail])
+                in_positions[in_offsets[index] + i] = kept++;
+    }
+
+    // compact in place
+    for (auto iter = vertices.begin(); iter != vertices.end();) {
+        index_t index = iter.index();
+        if (marked[index]) {
+            recycle(*iter);
+            iter = vertices.erase(iter);
+            continue;
+        }
+        auto &edges = iter->edges;
+        index_t kept = 0;
+        for (index_t i = 0; i != edges.size(); ++i) {
+            EdgeNode edge = edges[i];
+            if (marked[edge.head])
+                continue;
+            if (paired)
+                edge.mate = positions[offsets[edge.head] + edge.mate];
+            else
+                edge.mate = in_positions[in_offsets[edge.head] + edge.mate];
+            edges[kept++] = edge;
+        }
+        edges.resize(kept);
+
+        auto &in_edges = iter->in_edges;
+        kept = 0;
+        for (index_t i = 0; i != in_edges.size(); ++i) {
+            EdgeRef ref = in_edges[i];
+            if (marked[ref.tail])
+                continue;
+            ref.pos = positions[offsets[ref.tail] + ref.pos];
+            in_edges[kept++] = ref;
+        }
+        in_edges.resize(kept);
+        ++iter;
+    }
+}
+
 template <typename ValueT, typename WeightT, typename Compare,
           typename Allocator>
 void Digraph<ValueT, WeightT, Compare, Allocator>::insert_edge(
@@ -357,8 +543,26 @@ void Digraph<ValueT, WeightT, Compare, Allocator>::insert_edge(
     typename set_type::const_iterator &ctail_iter = tail;
     typename set_type::const_iterator &head_iter = head;
     auto tail_iter = iter_remove_c(ctail_iter);
+    index_t head_index = head_iter.index();
+    auto &in_edges = vertices[head_index].in_edges;
+
+    in_edges.push_back(
+        {.tail = ctail_iter.index(), .pos = tail_iter->edges.size()});
+    tail_iter->edges.push_back(
+        {.weight = weight, .head = head_index, .mate = in_edges.size() - 1});
+}
 
-    tail_iter->edges.push_front({.weight = weight, .head = head_iter.index()});
+template <typename ValueT, typename WeightT, typename Compare,
+          typename Allocator>
+void Digraph<ValueT, WeightT, Compare, Allocator>::insert_paired_edge(
+    index_t v1, index_t v2, const WeightT &weight) {
+    auto &edges1 = vertices[v1].edges;
+    auto &edges2 = vertices[v2].edges;
+    index_t pos1 = edges1.size();
+    index_t pos2 = edges2.size() + (v1 == v2);
+
+    edges1.push_back({.weight = weight, .head = v2, .mate = pos2});
+    edges2.push_back({.weight = weight, .head = v1, .mate = pos1});
 }
 
 template <typename ValueT, typename WeightT, typename Compare,
@@ -367,10 +571,11 @@ typename Digraph<ValueT, WeightT, Compare, Allocator>::edge_iterator
 Digraph<ValueT, WeightT, Compare, Allocator>::erase_after_edge(
     const_vertex_iterator tail, const_edge_iterator edge) {
     typename set_type::const_iterator &ctail_iter = tail;
-    auto tail_iter = iter_remove_c(ctail_iter);
+    index_t tail_index = ctail_iter.index();
+    index_t pos = edge.index() + 1;
 
-    auto result = tail_iter->edges.erase_after(edge);
-    return result;
+    erase_edge(tail_index, pos);
+    return {&vertices[tail_index].edges, pos};
 }
 template <typename ValueT, typename WeightT, typename Compare,
           typename Allocator>
@@ -379,34 +584,109 @@ Digraph<ValueT, WeightT, Compare, Allocator>::erase_after_edge(
     const_vertex_iterator tail, const_edge_iterator beg,
     const_edge_iterator end) {
     typename set_type::const_iterator &ctail_iter = tail;
-    auto tail_iter = iter_remove_c(ctail_iter);
+    index_t tail_index = ctail_iter.index();
+    auto &edges = vertices[tail_index].edges;
+    index_t first = beg.index() + 1;
+    index_t last = end.index();
+
+    // keeps the order, so the edges past the range stay past it
+    for (index_t i = first; i != last; ++i) {
+        const EdgeNode &edge = edges[i];
+        if (paired)
+            unlink(edge.head, edge.mate);
+        else
+            unlink_in_edge(edge.head, edge.mate);
+    }
+    edges.erase(edges.begin() + first, edges.begin() + last);
+    for (index_t i = first; i != edges.size(); ++i)
+        relink(tail_index, i);
+    return {&edges, first};
+}
+
+template <typename ValueT, typename WeightT, typename Compare,
+          typename Allocator>
+typename Digraph<ValueT, WeightT, Compare, Allocator>::vertex_iterator
+Digraph<ValueT, WeightT, Compare, Allocator>::reuse(vertex_iterator vertex) {
+    if (!spare_edges.empty()) {
+        vertex->edges.swap(spare_edges.back());
+        spare_edges.pop_back();
+    }
+    if (!spare_in_edges.empty()) {
+        vertex->in_edges.swap(spare_in_edges.back());
+        spare_in_edges.pop_back();
+    }
+    return vertex;
+}
 
-    auto before_count = vertices.size();
-    auto result = tail_iter->edges.erase_after(beg, end);
-    return result;
+template <typename ValueT, typename WeightT, typename Compare,
+          typename Allocator>
+void Digraph<ValueT, WeightT, Compare, Allocator>::recycle(Vertex &vertex) {
+    if (vertex.edges.capacity() && spare_edges.size() < max_spare) {
+        vertex.edges.clear();
+        spare_edges.push_back(std::move(vertex.edges));
+    }
+    if (vertex.in_edges.capacity() && spare_in_edges.size() < max_spare) {
+        vertex.in_edges.clear();
+        spare_in_edges.push_back(std::move(vertex.in_edges));
+    }
 }
 
 template <typename ValueT, typename WeightT, typename Compare,
           typename Allocator>
-typename UndirectedGraph<ValueT, WeightT, Compare, Allocator>::edge_iterator
-UndirectedGraph<ValueT, WeightT, Compare, Allocator>::erase_after_edge(
-    const_vertex_iterator v1, const_edge_iterator edge) {
-    auto target = edge;
-    ++target;
-
-    auto result = Digraph::erase_after_edge(v1, edge);
-    auto v2 = get_vertex_iterator(target->head);
-    if (v1 != v2) {
-        index_t index = v1.index();
-        for (auto iter = v2->cbegin(), pre = v2->cbefore_begin();
-             iter != v2->cend(); ++iter, ++pre) {
-            if (iter->head == index && iter->weight == target->weight) {
-                Digraph::erase_after_edge(v2, pre);
-                break;
-            }
-        }
+void Digraph<ValueT, WeightT, Compare, Allocator>::erase_edge(index_t tail,
+                                                              index_t pos) {
+    const EdgeNode &edge = vertices[tail].edges[pos];
+    index_t head = edge.head;
+    index_t mate = edge.mate;
+    if (!paired) {
+        unlink_in_edge(head, mate);
+        unlink(tail, pos);
+    } else if (head != tail) {
+        unlink(tail, pos);
+        unlink(head, mate);
+    } else {
+        // a loop, both halves in the same list
+        unlink(tail, std::max(pos, mate));
+        unlink(tail, std::min(pos, mate));
     }
-    return result;
+}
+
+template <typename ValueT, typename WeightT, typename Compare,
+          typename Allocator>
+void Digraph<ValueT, WeightT, Compare, Allocator>::unlink(index_t tail,
+                                                          index_t pos) {
+    auto &edges = vertices[tail].edges;
+    if (pos + 1 != edges.size()) {
+        edges[pos] = edges.back();
+        edges.pop_back();
+        relink(tail, pos);
+    } else
+        edges.pop_back();
+}
+
+template <typename ValueT, typename WeightT, typename Compare,
+          typename Allocator>
+void Digraph<ValueT, WeightT, Compare, Allocator>::unlink_in_edge(
+    index_t head, index_t pos) {
+    auto &in_edges = vertices[head].in_edges;
+    if (pos + 1 != in_edges.size()) {
+        in_edges[pos] = in_edges.back();
+        in_edges.pop_back();
+        const EdgeRef &ref = in_edges[pos];
+        vertices[ref.tail].edges[ref.pos].mate = pos;
+    } else
+        in_edges.pop_back();
+}
+
+template <typename ValueT, typename WeightT, typename Compare,
+          typename Allocator>
+void Digraph<ValueT, WeightT, Compare, Allocator>::relink(index_t tail,
+                                                          index_t pos) {
+    const EdgeNode &edge = vertices[tail].edges[pos];
+    if (paired)
+        vertices[edge.head].edges[edge.mate].mate = pos;
+    else
+        vertices[edge.head].in_edges[edge.mate].pos = pos;
 }
 
 } // namespace GPSOINN
@@ -1,6 +1,11 @@
 #include "graph.hxx"
 #include <gtest/gtest.h>
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <random>
+#include <tuple>
+#include <vector>
 
 using namespace GPSOINN;
 
@@ -82,3 +87,135 @@ TEST(UndirenctedGraph, insert_erase_vertex) {
             std::cout << ver.value() << " - " << edge.head << " " << edge.weight
                       << std::endl;
 }
+
+TEST(UndirenctedGraph, erase_reverse_edge) {
+    UndirectedGraph<unsigned, int> graph;
+    for (int i = 0; i != 3; ++i) {
+        graph.insert_vertex(i);
+    }
+    graph.insert_edge(0, 1, 0);
+    graph.insert_edge(0, 1, 0);
+    graph.insert_edge(1, 2, 0);
+    // age one side only, as the network does
+    for (auto &edge : graph[0])
+        edge.weight += 3;
+
+    auto v0 = graph.get_vertex_iterator(0);
+    auto next = graph.erase_after_edge(v0, v0->cbefore_begin());
+    EXPECT_EQ(next, graph[0].begin());
+    EXPECT_EQ(1, graph[0].degree());
+    EXPECT_EQ(2, graph[1].degree());
+
+    graph.erase_vertex(graph.get_vertex_iterator(1));
+    EXPECT_EQ(0, graph[0].degree());
+    EXPECT_EQ(0, graph[2].degree());
+}
+
+namespace {
+
+typedef std::map<size_t, std::vector<std::pair<size_t, int>>> EdgeModel;
+
+// every vertex against the expected (head, weight) pairs, and the mates of
+// an undirected graph pointing back
+template <typename Graph>
+void check_edges(const Graph &graph, EdgeModel model, bool paired) {
+    ASSERT_EQ(model.size(), graph.vertex_count());
+    for (auto iter = graph.cbegin(); iter != graph.cend(); ++iter) {
+        size_t index = iter.index();
+        std::vector<std::pair<size_t, int>> edges;
+        for (auto &edge : *iter) {
+            edges.emplace_back(edge.head, edge.weight);
+            if (paired) {
+                auto &mate = *std::next(graph[edge.head].cbegin(), edge.mate);
+                EXPECT_EQ(index, mate.head);
+                EXPECT_EQ(edge.weight, mate.weight);
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        auto &expected = model[index];
+        std::sort(expected.begin(), expected.end());
+        EXPECT_EQ(expected, edges) << "vertex " << index;
+        EXPECT_EQ(expected.size(), iter->degree());
+    }
+}
+
+// random edits against a plain list of edges, weights telling edges apart
+template <typename Graph> void random_edits(bool paired) {
+    Graph graph;
+    EdgeModel model;
+    std::mt19937 rng(paired);
+    int weight = 0;
+    auto erase_model = [&](size_t index) {
+        model.erase(index);
+        for (auto &vertex : model) {
+            auto &edges = vertex.second;
+            edges.erase(std::remove_if(edges.begin(), edges.end(),
+                                       [&](const std::pair<size_t, int> &e) {
+                                           return e.first == index;
+                                       }),
+                        edges.end());
+        }
+    };
+    auto pick = [&]() {
+        auto iter = model.begin();
+        std::advance(iter, rng() % model.size());
+        return iter->first;
+    };
+
+    for (int step = 0; step != 3000; ++step) {
+        unsigned op = rng() % 10;
+        if (op < 2 || model.size() < 2) {
+            size_t index = graph.insert_vertex(step).index();
+            model[index];
+        } else if (op < 6) {
+            size_t tail = pick(), head = pick();
+            graph.insert_edge(tail, head, ++weight);
+            model[tail].emplace_back(head, weight);
+            if (paired)
+                model[head].emplace_back(tail, weight);
+        } else if (op < 8) {
+            size_t tail = pick();
+            if (!graph[tail].degree())
+                continue;
+            auto pre = graph[tail].cbefore_begin();
+            std::advance(pre, rng() % graph[tail].degree());
+            auto edge = std::next(pre);
+            auto removed = std::make_pair(edge->head, edge->weight);
+            auto &edges = model[tail];
+            edges.erase(std::find(edges.begin(), edges.end(), removed));
+            if (paired) {
+                auto &others = model[removed.first];
+                others.erase(std::find(others.begin(), others.end(),
+                                       std::make_pair(tail, removed.second)));
+            }
+            graph.erase_after_edge(graph.get_vertex_iterator(tail), pre);
+        } else if (op < 9) {
+            size_t index = pick();
+            graph.erase_vertex(graph.get_vertex_iterator(index));
+            erase_model(index);
+        } else {
+            unsigned mod = 2 + rng() % 5;
+            std::vector<size_t> erased;
+            auto count = graph.erase_vertex_if([&](auto iter) {
+                if (iter.index() % mod)
+                    return false;
+                erased.push_back(iter.index());
+                return true;
+            });
+            EXPECT_EQ(erased.size(), count);
+            for (auto index : erased)
+                erase_model(index);
+        }
+        check_edges(graph, model, paired);
+        if (testing::Test::HasFailure())
+            FAIL() << "step " << step;
+    }
+}
+
+} // namespace
+
+TEST(Digraph, random_edits) { random_edits<Digraph<int, int>>(false); }
+
+TEST(UndirenctedGraph, random_edits) {
+    random_edits<UndirectedGraph<int, int>>(true);
+}
@@ -4,6 +4,7 @@
 #include <cstring>
 #include <functional>
 #include <iterator>
+#include <type_traits>
 #include <vector>
 
 namespace GPSOINN {
@@ -35,11 +36,11 @@ template <typename T, typename T_2> struct multiset_variant {
         else
             new (&data) T(*reinterpret_cast<const T *>(other));
     }
-    inline void move(const data_t *other) {
+    inline void move(data_t *other) {
         if (bit)
-            new (&data) T_2(std::move(*reinterpret_cast<const T_2 *>(other)));
+            new (&data) T_2(std::move(*reinterpret_cast<T_2 *>(other)));
         else
-            new (&data) T(std::move(*reinterpret_cast<const T *>(other)));
+            new (&data) T(std::move(*reinterpret_cast<T *>(other)));
     }
     inline void destroy() {
         if (bit)
@@ -54,8 +55,11 @@ template <typename T, typename T_2> struct multiset_variant {
     multiset_variant(const multiset_variant &other) : bit(other.bit) {
         copy(&other.data);
     }
-    // move constructor
-    multiset_variant(multiset_variant &&other) : bit(other.bit) {
+    // move constructor, noexcept so that growing the vector moves
+    multiset_variant(multiset_variant &&other) noexcept(
+        std::is_nothrow_move_constructible<T>::value &&
+        std::is_nothrow_move_constructible<T_2>::value)
+        : bit(other.bit) {
         move(&other.data);
     }
 
@@ -510,7 +514,7 @@ multiset<Key, Compare, Allocator>::multiset(multiset &&other,
 template <typename Key, typename Compare, typename Allocator>
 multiset<Key, Compare, Allocator> &multiset<Key, Compare, Allocator>::
 operator=(multiset other) {
-    std::swap(*this, other);
+    swap(*this, other);
     return *this;
 }
 template <typename Key, typename Compare, typename Allocator>
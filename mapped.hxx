@@ -0,0 +1,95 @@
+#ifndef GPSOINN_MAPPED_HXX
+#define GPSOINN_MAPPED_HXX
+
+#include "mixture.hxx"
+#include "snapshot.hxx"
+
+#include <Eigen/Dense>
+#include <fcntl.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace GPSOINN {
+
+// A snapshot mapped read-only and scored in place: nothing is parsed or
+// copied, and processes mapping the same file share its pages. Needs a
+// snapshot saved with its mixture.
+template <int dimension> class MappedNet {
+  public:
+    typedef Eigen::Matrix<double, dimension, 1> NodeVector;
+    typedef Eigen::Matrix<double, dimension, Eigen::Dynamic> SampleMatrix;
+
+    explicit MappedNet(const std::string &path);
+
+    double predict(const NodeVector &x_vector) const {
+        return m_mixture.predict(x_vector);
+    }
+    // one sample per column
+    Eigen::VectorXd
+    predict_batch(const Eigen::Ref<const SampleMatrix> &samples,
+                  const BatchOptions &options = BatchOptions()) {
+        return m_scorer.predict(m_mixture, samples, options);
+    }
+    // count samples stored one after another
+    void predict_batch(const double *data, size_t count, double *result,
+                       const BatchOptions &options = BatchOptions()) {
+        m_scorer.predict(m_mixture, data, count, result, options);
+    }
+
+    const SnapshotHeader &header() const noexcept { return *m_header; }
+    Eigen::Index dim() const noexcept { return m_mixture.dim(); }
+
+  private:
+    std::shared_ptr<const void> m_mapping;
+    const SnapshotHeader *m_header;
+    GaussianMixture<dimension> m_mixture;
+    BatchScorer<dimension> m_scorer;
+};
+
+} // namespace GPSOINN
+
+namespace GPSOINN {
+
+template <int dimension>
+MappedNet<dimension>::MappedNet(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("cannot open " + path);
+    struct stat status;
+    if (::fstat(fd, &status) ||
+        size_t(status.st_size) < sizeof(SnapshotHeader)) {
+        ::close(fd);
+        throw std::runtime_error("not a GPSOINN snapshot: " + path);
+    }
+    size_t size = status.st_size;
+    void *address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED)
+        throw std::runtime_error("cannot map " + path);
+    m_mapping = std::shared_ptr<const void>(
+        address, [size](const void *address) {
+            ::munmap(const_cast<void *>(address), size);
+        });
+
+    m_header = static_cast<const SnapshotHeader *>(address);
+    snapshot_check(*m_header, size);
+    if (dimension != Eigen::Dynamic &&
+        m_header->dimension != uint64_t(dimension))
+        throw std::runtime_error("snapshot of another dimension");
+    if (!m_header->components)
+        throw std::runtime_error("snapshot saved without its mixture");
+
+    const char *base = static_cast<const char *>(address);
+    m_mixture = GaussianMixture<dimension>::view(
+        m_header->dimension, m_header->components, m_header->weight_sum,
+        reinterpret_cast<const double *>(base + m_header->mixture),
+        m_mapping);
+}
+
+} // namespace GPSOINN
+
+#endif // GPSOINN_MAPPED_HXX
@@ -0,0 +1,373 @@
+#ifndef GPSOINN_MIXTURE_HXX
+#define GPSOINN_MIXTURE_HXX
+
+#include "thread_pool.hxx"
+
+#include <Eigen/Dense>
+#include <Eigen/StdVector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+
+namespace GPSOINN {
+
+struct BatchOptions {
+    // 0 for one thread per hardware thread
+    unsigned threads = 0;
+    // skip nodes for a block of samples while their weighted densities
+    // certainly add up to less than this for every sample of the block, so
+    // no density is off by more
+    double tolerance = 0;
+    // score log densities instead of densities
+    bool log_density = false;
+};
+
+// The network frozen into a gaussian mixture laid out for scoring: the
+// inverse cholesky factors of all nodes stacked into one matrix, so the
+// mahalanobis distances of a block of samples are a GEMM per node.
+// Everything lives in one block of sections padded to 64 bytes, which is
+// also how snapshots store it, so a mapped snapshot is scored in place.
+template <int dimension> class GaussianMixture {
+  public:
+    typedef Eigen::Matrix<double, dimension, 1> NodeVector;
+    typedef Eigen::Matrix<double, dimension, dimension> CovMatrix;
+    typedef Eigen::Matrix<double, dimension, Eigen::Dynamic> SampleMatrix;
+
+    explicit GaussianMixture(Eigen::Index dim = dimension) : m_dim(dim) {}
+    // a read-only mixture over count components laid out as data() would
+    // be, keep holding whatever owns them
+    static GaussianMixture view(Eigen::Index dim, size_t count,
+                                double weight_sum, const double *data,
+                                std::shared_ptr<const void> keep);
+
+    // modifiers
+    void resize(size_t count);
+    // factor holds the cholesky factor L of the covariance in its lower
+    // triangle, as LLT::matrixLLT does
+    void set(size_t index, const Eigen::Ref<const NodeVector> &mean,
+             const Eigen::Ref<const CovMatrix> &factor, double log_det,
+             double weight);
+
+    /* capacity */
+    size_t size() const noexcept { return m_count; }
+    Eigen::Index dim() const noexcept { return m_dim; }
+
+    // raw layout
+    const double *data() const noexcept {
+        return m_view ? m_view : m_buffer.data();
+    }
+    // in doubles
+    static size_t data_size(Eigen::Index dim, size_t count) {
+        return offset(dim, count, section_count);
+    }
+    double weight_sum() const noexcept { return m_weight_sum; }
+
+    // scoring
+    double predict(const NodeVector &x_vector) const;
+    void predict(const Eigen::Ref<const SampleMatrix> &samples, double *result,
+                 const BatchOptions &options, ThreadPool &pool) const;
+
+  private:
+    // samples per task
+    static constexpr Eigen::Index block_size = 128;
+    // nodes per bound computation
+    static constexpr Eigen::Index chunk_size = 256;
+
+    struct Workspace {
+        SampleMatrix diffs;
+        Eigen::MatrixXd dots;
+        Eigen::ArrayXd x_norms;
+        Eigen::ArrayXd maxs;
+        Eigen::ArrayXd sums;
+        Eigen::ArrayXd terms;
+        Eigen::ArrayXd scales;
+    };
+
+    typedef Eigen::Matrix<double, dimension, Eigen::Dynamic> NodeMatrix;
+
+    enum Section {
+        means_section,
+        // L^-1 of node i in columns [i * m_dim, (i + 1) * m_dim)
+        factors_section,
+        // L^-1 u
+        shifts_section,
+        // log(w) - log|S| / 2 - log(2 pi) * d / 2
+        log_coeffs_section,
+        // 1 / tr(S) <= the smallest eigenvalue of S^-1
+        precisions_section,
+        // |u|^2
+        norms_section,
+        section_count
+    };
+
+    Eigen::Index m_dim;
+    size_t m_count = 0;
+    double m_weight_sum = 0;
+    std::vector<double, Eigen::aligned_allocator<double>> m_buffer;
+    // set for a view
+    const double *m_view = nullptr;
+    std::shared_ptr<const void> m_keep;
+
+    // in doubles
+    static size_t offset(Eigen::Index dim, size_t count, int section);
+    template <typename Matrix>
+    Eigen::Map<const Matrix> section(int section, Eigen::Index rows,
+                                     Eigen::Index cols) const {
+        return {data() + offset(m_dim, m_count, section), rows, cols};
+    }
+    auto means() const {
+        return section<NodeMatrix>(means_section, m_dim, m_count);
+    }
+    auto factors() const {
+        return section<NodeMatrix>(factors_section, m_dim, m_dim * m_count);
+    }
+    auto shifts() const {
+        return section<NodeMatrix>(shifts_section, m_dim, m_count);
+    }
+    auto log_coeffs() const {
+        return section<Eigen::VectorXd>(log_coeffs_section, m_count, 1);
+    }
+    auto precisions() const {
+        return section<Eigen::VectorXd>(precisions_section, m_count, 1);
+    }
+    auto norms() const {
+        return section<Eigen::VectorXd>(norms_section, m_count, 1);
+    }
+    void score(const Eigen::Ref<const SampleMatrix> &samples, double *result,
+               const BatchOptions &options, Workspace &space) const;
+};
+
+// Scores batches against a mixture on a thread pool kept between batches
+// of the same thread count. Copies start without a pool.
+template <int dimension> class BatchScorer {
+  public:
+    typedef Eigen::Matrix<double, dimension, Eigen::Dynamic> SampleMatrix;
+
+    BatchScorer() = default;
+    BatchScorer(const BatchScorer &) {}
+    BatchScorer(BatchScorer &&) = default;
+    BatchScorer &operator=(const BatchScorer &) { return *this; }
+    BatchScorer &operator=(BatchScorer &&) = default;
+
+    // one sample per column
+    Eigen::VectorXd predict(const GaussianMixture<dimension> &mixture,
+                            const Eigen::Ref<const SampleMatrix> &samples,
+                            const BatchOptions &options);
+    // count samples stored one after another
+    void predict(const GaussianMixture<dimension> &mixture, const double *data,
+                 size_t count, double *result, const BatchOptions &options);
+
+  private:
+    std::unique_ptr<ThreadPool> m_pool;
+    ThreadPool &pool(unsigned threads);
+};
+
+} // namespace GPSOINN
+
+namespace GPSOINN {
+
+template <int dimension>
+GaussianMixture<dimension> GaussianMixture<dimension>::view(
+    Eigen::Index dim, size_t count, double weight_sum, const double *data,
+    std::shared_ptr<const void> keep) {
+    GaussianMixture mixture(dim);
+    mixture.m_count = count;
+    mixture.m_weight_sum = weight_sum;
+    mixture.m_view = data;
+    mixture.m_keep = std::move(keep);
+    return mixture;
+}
+
+template <int dimension> void GaussianMixture<dimension>::resize(size_t count) {
+    m_view = nullptr;
+    m_keep.reset();
+    m_count = count;
+    m_weight_sum = 0;
+    // zeroed padding, so snapshots of the same network are the same bytes
+    m_buffer.assign(data_size(m_dim, count), 0);
+}
+
+template <int dimension>
+size_t GaussianMixture<dimension>::offset(Eigen::Index dim, size_t count,
+                                          int section) {
+    const size_t sizes[section_count] = {
+        dim * count, dim * dim * count, dim * count, count, count, count,
+    };
+    size_t result = 0;
+    for (int i = 0; i != section; ++i)
+        result += (sizes[i] + 7) / 8 * 8;
+    return result;
+}
+
+template <int dimension>
+void GaussianMixture<dimension>::set(
+    size_t index, const Eigen::Ref<const NodeVector> &mean,
+    const Eigen::Ref<const CovMatrix> &factor, double log_det, double weight) {
+    using namespace Eigen;
+
+    double *data = m_buffer.data();
+    auto at = [&](int section) {
+        return data + offset(m_dim, m_count, section);
+    };
+    Map<NodeMatrix> factors(at(factors_section), m_dim, m_dim * m_count);
+    auto inv_factor =
+        factors.template block<dimension, dimension>(0, index * m_dim, m_dim,
+                                                     m_dim);
+    auto cov_factor = factor.template triangularView<Lower>();
+    inv_factor.setIdentity();
+    cov_factor.solveInPlace(inv_factor);
+
+    Map<NodeMatrix>(at(means_section), m_dim, m_count).col(index) = mean;
+    Map<NodeMatrix>(at(shifts_section), m_dim, m_count).col(index).noalias() =
+        inv_factor * mean;
+    at(log_coeffs_section)[index] =
+        std::log(weight) - (log_det + m_dim * std::log(2 * M_PI)) / 2;
+    at(precisions_section)[index] =
+        1 / cov_factor.toDenseMatrix().squaredNorm();
+    at(norms_section)[index] = mean.squaredNorm();
+    m_weight_sum += weight;
+}
+
+template <int dimension>
+double GaussianMixture<dimension>::predict(const NodeVector &x_vector) const {
+    auto factors = this->factors();
+    auto shifts = this->shifts();
+    auto log_coeffs = this->log_coeffs();
+    double prob = 0;
+    for (Eigen::Index i = 0; i != log_coeffs.size(); ++i) {
+        auto factor = factors.template block<dimension, dimension>(
+            0, i * m_dim, m_dim, m_dim);
+        double distance = (factor * x_vector - shifts.col(i)).squaredNorm();
+        prob += std::exp(log_coeffs(i) - distance / 2);
+    }
+    if (m_weight_sum)
+        prob /= m_weight_sum;
+    return prob;
+}
+
+template <int dimension>
+void GaussianMixture<dimension>::predict(
+    const Eigen::Ref<const SampleMatrix> &samples, double *result,
+    const BatchOptions &options, ThreadPool &pool) const {
+    Eigen::Index count = samples.cols();
+    size_t blocks = (count + block_size - 1) / block_size;
+    std::vector<Workspace> spaces(pool.size());
+    pool.run(blocks, [&](unsigned worker, size_t block) {
+        Eigen::Index begin = block * block_size;
+        Eigen::Index width = std::min(block_size, count - begin);
+        score(samples.middleCols(begin, width), result + begin, options,
+              spaces[worker]);
+    });
+}
+
+template <int dimension>
+void GaussianMixture<dimension>::score(
+    const Eigen::Ref<const SampleMatrix> &samples, double *result,
+    const BatchOptions &options, Workspace &space) const {
+    using namespace Eigen;
+
+    Index width = samples.cols();
+    Index nodes = m_count;
+    double log_sum = std::log(m_weight_sum);
+    auto means = this->means();
+    auto factors = this->factors();
+    auto shifts = this->shifts();
+    auto log_coeffs = this->log_coeffs();
+    auto precisions = this->precisions();
+    auto norms = this->norms();
+
+    // grows to the largest block once per thread, never per sample
+    space.diffs.resize(m_dim, width);
+    space.maxs.resize(width);
+    space.sums.resize(width);
+    space.terms.resize(width);
+    space.scales.resize(width);
+    space.maxs.setConstant(-std::numeric_limits<double>::infinity());
+    space.sums.setZero();
+
+    bool prune = options.tolerance > 0;
+    // shared out evenly between the nodes
+    double log_tolerance =
+        prune ? std::log(options.tolerance / nodes) + log_sum : 0;
+    if (prune) {
+        space.dots.resize(std::min(chunk_size, nodes), width);
+        space.x_norms = samples.colwise().squaredNorm().transpose().array();
+    }
+
+    for (Index chunk = 0; chunk < nodes; chunk += chunk_size) {
+        Index chunk_nodes = std::min(chunk_size, nodes - chunk);
+        if (prune)
+            space.dots.topRows(chunk_nodes).noalias() =
+                means.middleCols(chunk, chunk_nodes).transpose() * samples;
+
+        for (Index i = chunk; i != chunk + chunk_nodes; ++i) {
+            if (prune) {
+                // |L^-1 (x - u)|^2 >= |x - u|^2 / tr(S)
+                double nearest =
+                    (space.x_norms + norms(i) -
+                     2 * space.dots.row(i - chunk).transpose().array())
+                        .minCoeff();
+                if (log_coeffs(i) -
+                        std::max(nearest, 0.0) * precisions(i) / 2 <
+                    log_tolerance)
+                    continue;
+            }
+
+            space.diffs.noalias() =
+                factors.template block<dimension, dimension>(0, i * m_dim,
+                                                             m_dim, m_dim) *
+                samples;
+            space.diffs.colwise() -= shifts.col(i);
+            space.terms =
+                log_coeffs(i) -
+                space.diffs.colwise().squaredNorm().transpose().array() / 2;
+
+            // running log-sum-exp
+            space.scales = space.maxs.max(space.terms);
+            space.sums = space.sums * (space.maxs - space.scales).exp() +
+                         (space.terms - space.scales).exp();
+            space.maxs.swap(space.scales);
+        }
+    }
+
+    for (Index j = 0; j != width; ++j) {
+        double log_prob =
+            space.sums(j) ? space.maxs(j) + std::log(space.sums(j)) - log_sum
+                          : -std::numeric_limits<double>::infinity();
+        result[j] = options.log_density ? log_prob : std::exp(log_prob);
+    }
+}
+
+template <int dimension>
+Eigen::VectorXd
+BatchScorer<dimension>::predict(const GaussianMixture<dimension> &mixture,
+                                const Eigen::Ref<const SampleMatrix> &samples,
+                                const BatchOptions &options) {
+    Eigen::VectorXd result(samples.cols());
+    mixture.predict(samples, result.data(), options, pool(options.threads));
+    return result;
+}
+
+template <int dimension>
+void BatchScorer<dimension>::predict(const GaussianMixture<dimension> &mixture,
+                                     const double *data, size_t count,
+                                     double *result,
+                                     const BatchOptions &options) {
+    Eigen::Map<const SampleMatrix> samples(data, mixture.dim(), count);
+    mixture.predict(samples, result, options, pool(options.threads));
+}
+
+template <int dimension>
+ThreadPool &BatchScorer<dimension>::pool(unsigned threads) {
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    if (!m_pool || m_pool->size() != threads)
+        m_pool.reset(new ThreadPool(threads));
+    return *m_pool;
+}
+
+} // namespace GPSOINN
+
+#endif // GPSOINN_MIXTURE_HXX
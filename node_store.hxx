@@ -0,0 +1,104 @@
+#ifndef GPSOINN_NODE_STORE_HXX
+#define GPSOINN_NODE_STORE_HXX
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+namespace GPSOINN {
+
+// The vectors of the nodes in one column-major buffer, one column per slot
+// of the graph, so the slot index of a vertex is its column. Free slots
+// hold infinity and never win a search.
+template <int dimension, typename Scalar = double> class NodeStore {
+  public:
+    typedef Eigen::Matrix<Scalar, dimension, 1> NodeVector;
+    typedef Eigen::Matrix<Scalar, dimension, Eigen::Dynamic> NodeMatrix;
+    typedef Eigen::Index Index;
+
+    explicit NodeStore(Index dim = dimension) : m_data(dim, 0) {}
+
+    // modifiers
+    void insert(Index slot, const Eigen::Ref<const NodeVector> &vector);
+    void erase(Index slot) {
+        m_data.col(slot).setConstant(std::numeric_limits<Scalar>::infinity());
+    }
+    void clear() noexcept { m_slots = 0; }
+
+    // element access
+    auto col(Index slot) { return m_data.col(slot); }
+    auto col(Index slot) const { return m_data.col(slot); }
+
+    /* capacity */
+    Index slots() const noexcept { return m_slots; }
+    Index dim() const noexcept { return m_data.rows(); }
+
+    // the nearest and the second nearest slot, ties going to the lower one
+    std::pair<Index, Index>
+    nearest2(const Eigen::Ref<const NodeVector> &x_vector) const;
+
+  private:
+    // columns scored at a time, small enough to stay on the stack
+    static constexpr Index chunk_size = 256;
+
+    NodeMatrix m_data;
+    Index m_slots = 0;
+};
+
+} // namespace GPSOINN
+
+namespace GPSOINN {
+
+template <int dimension, typename Scalar>
+void NodeStore<dimension, Scalar>::insert(
+    Index slot, const Eigen::Ref<const NodeVector> &vector) {
+    Index capacity = m_data.cols();
+    if (slot >= capacity) {
+        Index grown = std::max({slot + 1, 2 * capacity, Index(16)});
+        m_data.conservativeResize(Eigen::NoChange, grown);
+        m_data.rightCols(grown - capacity)
+            .setConstant(std::numeric_limits<Scalar>::infinity());
+    }
+    m_data.col(slot) = vector;
+    m_slots = std::max(m_slots, slot + 1);
+}
+
+template <int dimension, typename Scalar>
+std::pair<typename NodeStore<dimension, Scalar>::Index,
+          typename NodeStore<dimension, Scalar>::Index>
+NodeStore<dimension, Scalar>::nearest2(
+    const Eigen::Ref<const NodeVector> &x_vector) const {
+    Eigen::Matrix<Scalar, 1, Eigen::Dynamic, Eigen::RowMajor, 1, chunk_size>
+        distances;
+    Scalar min = std::numeric_limits<Scalar>::infinity();
+    Scalar min2 = min;
+    Index min_index = -1;
+    Index min2_index = -1;
+
+    for (Index begin = 0; begin < m_slots; begin += chunk_size) {
+        Index width = std::min(chunk_size, m_slots - begin);
+        distances.resize(width);
+        distances.noalias() = (m_data.middleCols(begin, width).colwise() -
+                               x_vector)
+                                  .colwise()
+                                  .squaredNorm();
+        for (Index i = 0; i != width; ++i) {
+            Scalar distance = distances(i);
+            if (distance < min) {
+                min2 = min;
+                min2_index = min_index;
+                min = distance;
+                min_index = begin + i;
+            } else if (distance < min2) {
+                min2 = distance;
+                min2_index = begin + i;
+            }
+        }
+    }
+    return {min_index, min2_index};
+}
+
+} // namespace GPSOINN
+
+#endif // GPSOINN_NODE_STORE_HXX
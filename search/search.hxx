@@ -0,0 +1,642 @@
+#ifndef GPSOINN_SEARCH_HXX
+#define GPSOINN_SEARCH_HXX
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace GPSOINN {
+
+// Nearest two neighbour search over points keyed by the slot index of
+// their vertex. The points are copied in, so the caller has to report
+// every insert, erase and move. Searches reuse scratch space and are not
+// thread safe.
+class NeighbourIndex {
+  public:
+    typedef size_t id_type;
+    static constexpr id_type npos = static_cast<id_type>(-1);
+
+    explicit NeighbourIndex(size_t dimension) : m_dimension(dimension) {}
+    virtual ~NeighbourIndex() = default;
+
+    // modifiers
+    virtual void insert(id_type id, const double *point) = 0;
+    virtual void erase(id_type id) = 0;
+    virtual void move(id_type id, const double *point) {
+        erase(id);
+        insert(id, point);
+    }
+    virtual void clear() = 0;
+    // a copy with the same points, for copies of the network
+    virtual std::unique_ptr<NeighbourIndex> clone() const = 0;
+
+    // the nearest and the second nearest point, ties going to the lower id;
+    // npos for the missing ones when there are less than two points
+    virtual std::pair<id_type, id_type> nearest2(const double *query) = 0;
+
+    /* capacity */
+    virtual size_t size() const noexcept = 0;
+    size_t dimension() const noexcept { return m_dimension; }
+
+  protected:
+    size_t m_dimension;
+
+    double distance(const double *left, const double *right) const {
+        double sum = 0;
+        for (size_t i = 0; i != m_dimension; ++i)
+            sum += (left[i] - right[i]) * (left[i] - right[i]);
+        return sum;
+    }
+
+    // the best two seen so far
+    struct Nearest2 {
+        double distance = std::numeric_limits<double>::infinity();
+        double distance2 = std::numeric_limits<double>::infinity();
+        id_type id = npos;
+        id_type id2 = npos;
+
+        void offer(double dist, id_type candidate) {
+            if (dist < distance || (dist == distance && candidate < id)) {
+                distance2 = distance;
+                id2 = id;
+                distance = dist;
+                id = candidate;
+            } else if (dist < distance2 ||
+                       (dist == distance2 && candidate < id2)) {
+                distance2 = dist;
+                id2 = candidate;
+            }
+        }
+    };
+};
+
+// scans every point, the reference the other indices are checked against
+class BruteForceIndex : public NeighbourIndex {
+  public:
+    explicit BruteForceIndex(size_t dimension) : NeighbourIndex(dimension) {}
+
+    void insert(id_type id, const double *point) override;
+    void erase(id_type id) override;
+    void move(id_type id, const double *point) override;
+    void clear() override;
+    std::unique_ptr<NeighbourIndex> clone() const override {
+        return std::make_unique<BruteForceIndex>(*this);
+    }
+
+    std::pair<id_type, id_type> nearest2(const double *query) override;
+
+    size_t size() const noexcept override { return m_count; }
+
+  private:
+    std::vector<double> m_points;
+    std::vector<bool> m_valid;
+    size_t m_count = 0;
+};
+
+// Exact search on a kd-tree with buckets of points at the leaves. Points
+// go straight into the bucket of their leaf and full buckets split at the
+// median; the whole tree is rebuilt once the updates since the last
+// rebuild outnumber the points, which keeps it balanced at amortised
+// O(log n) per update.
+class KDTreeIndex : public NeighbourIndex {
+  public:
+    explicit KDTreeIndex(size_t dimension, size_t leaf_size = 16)
+        : NeighbourIndex(dimension), m_leaf_size(leaf_size) {}
+
+    void insert(id_type id, const double *point) override;
+    void erase(id_type id) override;
+    void clear() override;
+    std::unique_ptr<NeighbourIndex> clone() const override {
+        return std::make_unique<KDTreeIndex>(*this);
+    }
+
+    std::pair<id_type, id_type> nearest2(const double *query) override;
+
+    size_t size() const noexcept override { return m_count; }
+
+  private:
+    struct Node {
+        // npos for a leaf; points with point[axis] <= split go left
+        size_t axis = npos;
+        double split = 0;
+        size_t children[2];
+        std::vector<id_type> bucket;
+    };
+
+    size_t m_leaf_size;
+    std::vector<double> m_points;
+    // by id, npos when absent
+    std::vector<size_t> m_leaf;
+    // by id, position in the bucket of its leaf
+    std::vector<size_t> m_position;
+    std::vector<Node> m_nodes;
+    size_t m_count = 0;
+    size_t m_updates = 0;
+
+    const double *point(id_type id) const {
+        return m_points.data() + id * m_dimension;
+    }
+    void update();
+    void rebuild();
+    size_t build(id_type *beg, id_type *end);
+    void split(size_t leaf);
+    size_t widest_axis(const id_type *beg, const id_type *end) const;
+    void search(size_t node, const double *query, Nearest2 &best) const;
+};
+
+// Approximate search on a hierarchical navigable small world graph. ef is
+// the recall knob: the number of candidates kept while searching the
+// bottom layer. Erased points stay in the graph as waypoints until they
+// outnumber the live ones, then the graph is rebuilt from the live ones.
+class HNSWIndex : public NeighbourIndex {
+  public:
+    explicit HNSWIndex(size_t dimension, size_t links = 16, size_t ef = 32,
+                       size_t ef_construction = 64, unsigned seed = 0);
+
+    void insert(id_type id, const double *point) override;
+    void erase(id_type id) override;
+    void clear() override;
+    std::unique_ptr<NeighbourIndex> clone() const override {
+        return std::make_unique<HNSWIndex>(*this);
+    }
+
+    std::pair<id_type, id_type> nearest2(const double *query) override;
+
+    size_t size() const noexcept override { return m_count; }
+
+    void set_ef(size_t ef) noexcept { m_ef = ef; }
+    size_t ef() const noexcept { return m_ef; }
+
+  private:
+    typedef std::pair<double, size_t> Candidate;
+
+    struct Node {
+        id_type id;
+        bool erased = false;
+        // neighbours on every level the node lives on
+        std::vector<std::vector<size_t>> links;
+    };
+
+    size_t m_links;
+    size_t m_ef;
+    size_t m_ef_construction;
+    double m_level_scale;
+    std::mt19937 m_rng;
+
+    std::vector<Node> m_nodes;
+    std::vector<double> m_points;
+    // by id, npos when absent
+    std::vector<size_t> m_internal;
+    size_t m_entry = npos;
+    size_t m_count = 0;
+    size_t m_erased = 0;
+
+    // scratch for searches
+    std::vector<unsigned> m_visited;
+    unsigned m_visit_mark = 0;
+
+    const double *point(size_t node) const {
+        return m_points.data() + node * m_dimension;
+    }
+    size_t max_links(size_t level) const {
+        return level ? m_links : 2 * m_links;
+    }
+    size_t top() const { return m_nodes[m_entry].links.size() - 1; }
+    size_t add(id_type id, const double *point);
+    Candidate descend(const double *query, Candidate entry,
+                      size_t level) const;
+    void search_layer(const double *query, std::vector<Candidate> &found,
+                      size_t ef, size_t level);
+    void shrink(size_t node, size_t level);
+    void rebuild();
+};
+
+} // namespace GPSOINN
+
+namespace GPSOINN {
+
+inline void BruteForceIndex::insert(id_type id, const double *point) {
+    if (id >= m_valid.size()) {
+        m_valid.resize(id + 1);
+        m_points.resize((id + 1) * m_dimension);
+    }
+    if (!m_valid[id])
+        ++m_count;
+    m_valid[id] = true;
+    std::copy(point, point + m_dimension, m_points.begin() + id * m_dimension);
+}
+
+inline void BruteForceIndex::erase(id_type id) {
+    if (id < m_valid.size() && m_valid[id]) {
+        m_valid[id] = false;
+        --m_count;
+    }
+}
+
+inline void BruteForceIndex::move(id_type id, const double *point) {
+    // like the base, a point the index does not hold goes in
+    if (id >= m_valid.size() || !m_valid[id])
+        return insert(id, point);
+    std::copy(point, point + m_dimension, m_points.begin() + id * m_dimension);
+}
+
+inline void BruteForceIndex::clear() {
+    m_points.clear();
+    m_valid.clear();
+    m_count = 0;
+}
+
+inline std::pair<NeighbourIndex::id_type, NeighbourIndex::id_type>
+BruteForceIndex::nearest2(const double *query) {
+    Nearest2 best;
+    for (id_type id = 0; id != m_valid.size(); ++id)
+        if (m_valid[id])
+            best.offer(distance(query, m_points.data() + id * m_dimension),
+                       id);
+    return {best.id, best.id2};
+}
+
+inline void KDTreeIndex::insert(id_type id, const double *point) {
+    if (id < m_leaf.size() && m_leaf[id] != npos)
+        erase(id);
+    if (id >= m_leaf.size()) {
+        m_leaf.resize(id + 1, npos);
+        m_position.resize(id + 1);
+        m_points.resize((id + 1) * m_dimension);
+    }
+    std::copy(point, point + m_dimension, m_points.begin() + id * m_dimension);
+
+    if (m_nodes.empty())
+        m_nodes.emplace_back();
+    size_t node = 0;
+    while (m_nodes[node].axis != npos) {
+        const Node &inner = m_nodes[node];
+        node = inner.children[point[inner.axis] > inner.split];
+    }
+    m_leaf[id] = node;
+    m_position[id] = m_nodes[node].bucket.size();
+    m_nodes[node].bucket.push_back(id);
+    ++m_count;
+
+    if (m_nodes[node].bucket.size() > 2 * m_leaf_size)
+        split(node);
+    update();
+}
+
+inline void KDTreeIndex::erase(id_type id) {
+    if (id >= m_leaf.size() || m_leaf[id] == npos)
+        return;
+    auto &bucket = m_nodes[m_leaf[id]].bucket;
+    id_type last = bucket.back();
+    bucket[m_position[id]] = last;
+    m_position[last] = m_position[id];
+    bucket.pop_back();
+    m_leaf[id] = npos;
+    --m_count;
+    update();
+}
+
+inline void KDTreeIndex::clear() {
+    m_points.clear();
+    m_leaf.clear();
+    m_position.clear();
+    m_nodes.clear();
+    m_count = 0;
+    m_updates = 0;
+}
+
+inline std::pair<NeighbourIndex::id_type, NeighbourIndex::id_type>
+KDTreeIndex::nearest2(const double *query) {
+    Nearest2 best;
+    if (!m_nodes.empty())
+        search(0, query, best);
+    return {best.id, best.id2};
+}
+
+inline void KDTreeIndex::update() {
+    if (++m_updates > std::max(m_count, 4 * m_leaf_size))
+        rebuild();
+}
+
+inline void KDTreeIndex::rebuild() {
+    std::vector<id_type> ids;
+    ids.reserve(m_count);
+    for (id_type id = 0; id != m_leaf.size(); ++id)
+        if (m_leaf[id] != npos)
+            ids.push_back(id);
+
+    m_nodes.clear();
+    m_updates = 0;
+    build(ids.data(), ids.data() + ids.size());
+}
+
+inline size_t KDTreeIndex::build(id_type *beg, id_type *end) {
+    size_t node = m_nodes.size();
+    m_nodes.emplace_back();
+
+    size_t count = end - beg;
+    if (count > m_leaf_size) {
+        size_t axis = widest_axis(beg, end);
+        id_type *mid = beg + count / 2;
+        std::nth_element(beg, mid, end, [&](id_type left, id_type right) {
+            return point(left)[axis] < point(right)[axis];
+        });
+        double split = point(*mid)[axis];
+        id_type *bound = std::partition(
+            beg, end, [&](id_type id) { return point(id)[axis] <= split; });
+        if (bound != end) {
+            m_nodes[node].axis = axis;
+            m_nodes[node].split = split;
+            size_t left = build(beg, bound);
+            size_t right = build(bound, end);
+            m_nodes[node].children[0] = left;
+            m_nodes[node].children[1] = right;
+            return node;
+        }
+    }
+
+    // a leaf, also when every point sits on the split
+    auto &bucket = m_nodes[node].bucket;
+    bucket.assign(beg, end);
+    for (size_t i = 0; i != bucket.size(); ++i) {
+        m_leaf[bucket[i]] = node;
+        m_position[bucket[i]] = i;
+    }
+    return node;
+}
+
+inline void KDTreeIndex::split(size_t leaf) {
+    std::vector<id_type> ids;
+    ids.swap(m_nodes[leaf].bucket);
+    // build appends the subtree, which takes the place of the leaf
+    size_t sub = build(ids.data(), ids.data() + ids.size());
+    if (m_nodes[sub].axis == npos) {
+        // nothing to split on, keep the bucket as it is
+        m_nodes[leaf].bucket.swap(m_nodes[sub].bucket);
+        for (auto id : m_nodes[leaf].bucket)
+            m_leaf[id] = leaf;
+        m_nodes.pop_back();
+        return;
+    }
+    m_nodes[leaf] = std::move(m_nodes[sub]);
+    for (auto child : m_nodes[leaf].children)
+        if (m_nodes[child].axis == npos)
+            for (auto id : m_nodes[child].bucket)
+                m_leaf[id] = child;
+    // the subtree root is unreachable now, leave the slot to the rebuild
+}
+
+inline size_t KDTreeIndex::widest_axis(const id_type *beg,
+                                       const id_type *end) const {
+    size_t widest = 0;
+    double widest_spread = -1;
+    for (size_t axis = 0; axis != m_dimension; ++axis) {
+        double low = std::numeric_limits<double>::infinity();
+        double high = -low;
+        for (auto iter = beg; iter != end; ++iter) {
+            low = std::min(low, point(*iter)[axis]);
+            high = std::max(high, point(*iter)[axis]);
+        }
+        if (high - low > widest_spread) {
+            widest_spread = high - low;
+            widest = axis;
+        }
+    }
+    return widest;
+}
+
+inline void KDTreeIndex::search(size_t index, const double *query,
+                                Nearest2 &best) const {
+    const Node &node = m_nodes[index];
+    if (node.axis == npos) {
+        for (auto id : node.bucket)
+            best.offer(distance(query, point(id)), id);
+        return;
+    }
+
+    double offset = query[node.axis] - node.split;
+    bool near = offset > 0;
+    search(node.children[near], query, best);
+    // on a tie the far side may still hold a lower id
+    if (offset * offset <= best.distance2)
+        search(node.children[!near], query, best);
+}
+
+inline HNSWIndex::HNSWIndex(size_t dimension, size_t links, size_t ef,
+                            size_t ef_construction, unsigned seed)
+    : NeighbourIndex(dimension), m_links(std::max<size_t>(links, 2)),
+      m_ef(ef), m_ef_construction(std::max(ef_construction, links)),
+      m_level_scale(1 / std::log(double(m_links))), m_rng(seed) {}
+
+inline void HNSWIndex::insert(id_type id, const double *point) {
+    if (id < m_internal.size() && m_internal[id] != npos)
+        erase(id);
+    if (id >= m_internal.size())
+        m_internal.resize(id + 1, npos);
+    m_internal[id] = add(id, point);
+    ++m_count;
+}
+
+inline void HNSWIndex::erase(id_type id) {
+    if (id >= m_internal.size() || m_internal[id] == npos)
+        return;
+    m_nodes[m_internal[id]].erased = true;
+    m_internal[id] = npos;
+    ++m_erased;
+    if (--m_count == 0) {
+        m_nodes.clear();
+        m_points.clear();
+        m_entry = npos;
+        m_erased = 0;
+    } else if (m_erased > std::max<size_t>(m_count, 64))
+        rebuild();
+}
+
+inline void HNSWIndex::clear() {
+    m_nodes.clear();
+    m_points.clear();
+    m_internal.clear();
+    m_entry = npos;
+    m_count = 0;
+    m_erased = 0;
+}
+
+inline std::pair<NeighbourIndex::id_type, NeighbourIndex::id_type>
+HNSWIndex::nearest2(const double *query) {
+    Nearest2 best;
+    if (m_entry == npos)
+        return {best.id, best.id2};
+
+    Candidate entry(distance(query, point(m_entry)), m_entry);
+    for (size_t level = top(); level != 0; --level)
+        entry = descend(query, entry, level);
+
+    std::vector<Candidate> found{entry};
+    search_layer(query, found, std::max<size_t>(m_ef, 2), 0);
+    for (auto &candidate : found)
+        if (!m_nodes[candidate.second].erased)
+            best.offer(candidate.first, m_nodes[candidate.second].id);
+
+    if (best.id2 == npos && m_count >= 2) {
+        // cut off by erased nodes, fall back to a scan
+        best = Nearest2();
+        for (size_t node = 0; node != m_nodes.size(); ++node)
+            if (!m_nodes[node].erased)
+                best.offer(distance(query, point(node)), m_nodes[node].id);
+    }
+    return {best.id, best.id2};
+}
+
+inline size_t HNSWIndex::add(id_type id, const double *data) {
+    size_t node = m_nodes.size();
+    std::uniform_real_distribution<double> uniform(0, 1);
+    size_t level = -std::log(1 - uniform(m_rng)) * m_level_scale;
+
+    m_nodes.emplace_back();
+    m_nodes[node].id = id;
+    m_nodes[node].links.resize(level + 1);
+    m_points.insert(m_points.end(), data, data + m_dimension);
+    if (m_visited.size() < m_nodes.size())
+        m_visited.resize(2 * m_nodes.size());
+
+    if (m_entry == npos) {
+        m_entry = node;
+        return node;
+    }
+
+    size_t old_top = top();
+    Candidate entry(distance(data, point(m_entry)), m_entry);
+    for (size_t l = old_top; l > level; --l)
+        entry = descend(data, entry, l);
+
+    std::vector<Candidate> found{entry};
+    for (size_t l = std::min(level, old_top) + 1; l-- != 0;) {
+        search_layer(data, found, m_ef_construction, l);
+        auto &links = m_nodes[node].links[l];
+        for (auto &candidate : found) {
+            if (links.size() == m_links)
+                break;
+            if (!m_nodes[candidate.second].erased)
+                links.push_back(candidate.second);
+        }
+        // nothing live in reach, hang on to the waypoints
+        if (links.empty())
+            for (auto &candidate : found)
+                links.push_back(candidate.second);
+        for (auto neighbour : links) {
+            m_nodes[neighbour].links[l].push_back(node);
+            if (m_nodes[neighbour].links[l].size() > max_links(l))
+                shrink(neighbour, l);
+        }
+    }
+
+    if (level > old_top)
+        m_entry = node;
+    return node;
+}
+
+inline HNSWIndex::Candidate HNSWIndex::descend(const double *query,
+                                               Candidate entry,
+                                               size_t level) const {
+    // greedy walk towards the query
+    for (bool moved = true; moved;) {
+        moved = false;
+        for (auto neighbour : m_nodes[entry.second].links[level]) {
+            double dist = distance(query, point(neighbour));
+            if (dist < entry.first) {
+                entry = Candidate(dist, neighbour);
+                moved = true;
+            }
+        }
+    }
+    return entry;
+}
+
+inline void HNSWIndex::search_layer(const double *query,
+                                    std::vector<Candidate> &found, size_t ef,
+                                    size_t level) {
+    if (++m_visit_mark == 0) {
+        std::fill(m_visited.begin(), m_visited.end(), 0);
+        m_visit_mark = 1;
+    }
+
+    std::priority_queue<Candidate, std::vector<Candidate>,
+                        std::greater<Candidate>>
+        candidates;
+    // erased nodes are walked through but never returned
+    std::priority_queue<Candidate> results;
+    for (auto &entry : found) {
+        m_visited[entry.second] = m_visit_mark;
+        candidates.push(entry);
+        if (!m_nodes[entry.second].erased)
+            results.push(entry);
+    }
+    while (results.size() > ef)
+        results.pop();
+
+    while (!candidates.empty()) {
+        Candidate current = candidates.top();
+        if (results.size() >= ef && current.first > results.top().first)
+            break;
+        candidates.pop();
+        for (auto neighbour : m_nodes[current.second].links[level]) {
+            if (m_visited[neighbour] == m_visit_mark)
+                continue;
+            m_visited[neighbour] = m_visit_mark;
+            double dist = distance(query, point(neighbour));
+            if (results.size() < ef || dist < results.top().first) {
+                candidates.emplace(dist, neighbour);
+                if (m_nodes[neighbour].erased)
+                    continue;
+                results.emplace(dist, neighbour);
+                if (results.size() > ef)
+                    results.pop();
+            }
+        }
+    }
+
+    // nothing live in reach, carry on from the entries
+    if (results.empty())
+        return;
+    found.resize(results.size());
+    for (size_t i = found.size(); i-- != 0; results.pop())
+        found[i] = results.top();
+}
+
+inline void HNSWIndex::shrink(size_t node, size_t level) {
+    // keep the closest ones
+    auto &links = m_nodes[node].links[level];
+    std::vector<Candidate> ranked;
+    ranked.reserve(links.size());
+    for (auto neighbour : links)
+        ranked.emplace_back(distance(point(node), point(neighbour)),
+                            neighbour);
+    std::sort(ranked.begin(), ranked.end());
+    links.resize(max_links(level));
+    for (size_t i = 0; i != links.size(); ++i)
+        links[i] = ranked[i].second;
+}
+
+inline void HNSWIndex::rebuild() {
+    std::vector<Node> nodes;
+    std::vector<double> points;
+    nodes.swap(m_nodes);
+    points.swap(m_points);
+    m_entry = npos;
+    m_erased = 0;
+
+    for (size_t node = 0; node != nodes.size(); ++node)
+        if (!nodes[node].erased)
+            m_internal[nodes[node].id] =
+                add(nodes[node].id, points.data() + node * m_dimension);
+}
+
+} // namespace GPSOINN
+
+#endif // GPSOINN_SEARCH_HXX
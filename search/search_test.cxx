@@ -0,0 +1,170 @@
+#include "search.hxx"
+#include <gtest/gtest.h>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace GPSOINN;
+
+namespace {
+
+std::vector<double> random_point(std::mt19937 &rng, size_t dimension) {
+    std::normal_distribution<double> normal;
+    std::vector<double> point(dimension);
+    for (auto &x : point)
+        x = normal(rng);
+    return point;
+}
+
+// inserts, erases and moves like the network does, reusing freed slots
+// first, and checks every query against a brute force scan
+void check_exact(NeighbourIndex &index, size_t dimension) {
+    std::mt19937 rng(dimension);
+    BruteForceIndex reference(dimension);
+    std::vector<size_t> live, free;
+
+    for (size_t step = 0; step != 4000; ++step) {
+        unsigned op = rng() % 8;
+        if (op < 3 || live.size() < 2) {
+            size_t id = live.size() + free.size();
+            if (!free.empty()) {
+                id = free.back();
+                free.pop_back();
+            }
+            auto point = random_point(rng, dimension);
+            index.insert(id, point.data());
+            reference.insert(id, point.data());
+            live.push_back(id);
+        } else if (op < 4) {
+            size_t pos = rng() % live.size();
+            index.erase(live[pos]);
+            reference.erase(live[pos]);
+            free.push_back(live[pos]);
+            live[pos] = live.back();
+            live.pop_back();
+        } else {
+            size_t id = live[rng() % live.size()];
+            auto point = random_point(rng, dimension);
+            index.move(id, point.data());
+            reference.move(id, point.data());
+        }
+        ASSERT_EQ(reference.size(), index.size());
+
+        auto query = random_point(rng, dimension);
+        ASSERT_EQ(reference.nearest2(query.data()),
+                  index.nearest2(query.data()))
+            << "step " << step;
+    }
+}
+
+} // namespace
+
+TEST(BruteForceIndex, nearest2) {
+    BruteForceIndex index(1);
+    double query = 0;
+    EXPECT_EQ(NeighbourIndex::npos, index.nearest2(&query).first);
+
+    double points[] = {3, -1, 2, 1};
+    for (size_t i = 0; i != 4; ++i)
+        index.insert(i, points + i);
+    // 1 and 3 tie, the lower id wins
+    EXPECT_EQ(std::make_pair(size_t(1), size_t(3)), index.nearest2(&query));
+
+    index.erase(1);
+    EXPECT_EQ(std::make_pair(size_t(3), size_t(2)), index.nearest2(&query));
+    index.erase(2);
+    index.erase(0);
+    EXPECT_EQ(std::make_pair(size_t(3), NeighbourIndex::npos),
+              index.nearest2(&query));
+
+    // moving an erased or an unknown id inserts it
+    double moved[] = {0.5, -0.25};
+    index.move(0, moved);
+    index.move(7, moved + 1);
+    EXPECT_EQ(3u, index.size());
+    EXPECT_EQ(std::make_pair(size_t(7), size_t(0)), index.nearest2(&query));
+}
+
+TEST(KDTreeIndex, matches_brute_force) {
+    for (size_t dimension : {1, 3, 16}) {
+        KDTreeIndex index(dimension);
+        check_exact(index, dimension);
+    }
+}
+
+TEST(KDTreeIndex, duplicates) {
+    KDTreeIndex index(2, 4);
+    double point[] = {1, 1};
+    for (size_t i = 0; i != 100; ++i)
+        index.insert(i, point);
+    EXPECT_EQ(std::make_pair(size_t(0), size_t(1)), index.nearest2(point));
+    index.erase(0);
+    EXPECT_EQ(std::make_pair(size_t(1), size_t(2)), index.nearest2(point));
+}
+
+TEST(HNSWIndex, recall) {
+    const size_t dimension = 8;
+    const size_t count = 5000;
+    std::mt19937 rng(7);
+    HNSWIndex index(dimension, 16, 64);
+    BruteForceIndex reference(dimension);
+    for (size_t i = 0; i != count; ++i) {
+        auto point = random_point(rng, dimension);
+        index.insert(i, point.data());
+        reference.insert(i, point.data());
+    }
+    // churn so the graph carries erased waypoints and rebuilds
+    for (size_t i = 0; i != count; ++i) {
+        size_t id = rng() % count;
+        auto point = random_point(rng, dimension);
+        index.move(id, point.data());
+        reference.move(id, point.data());
+    }
+    ASSERT_EQ(count, index.size());
+
+    size_t hits = 0;
+    const size_t queries = 500;
+    for (size_t i = 0; i != queries; ++i) {
+        auto query = random_point(rng, dimension);
+        auto found = index.nearest2(query.data());
+        hits += found.first == reference.nearest2(query.data()).first;
+        EXPECT_NE(found.first, found.second);
+    }
+    EXPECT_GE(hits, queries * 9 / 10);
+}
+
+TEST(HNSWIndex, small) {
+    HNSWIndex index(1);
+    double points[] = {0, 5, 1};
+    index.insert(4, points);
+    double query = 0.9;
+    EXPECT_EQ(std::make_pair(size_t(4), NeighbourIndex::npos),
+              index.nearest2(&query));
+    index.insert(2, points + 1);
+    index.insert(9, points + 2);
+    EXPECT_EQ(std::make_pair(size_t(9), size_t(4)), index.nearest2(&query));
+    index.erase(9);
+    EXPECT_EQ(std::make_pair(size_t(4), size_t(2)), index.nearest2(&query));
+}
+
+TEST(HNSWIndex, refill) {
+    // the network may prune every node and start over
+    HNSWIndex index(2, 4);
+    std::mt19937 rng(3);
+    for (int round = 0; round != 3; ++round) {
+        std::vector<std::vector<double>> points;
+        for (size_t i = 0; i != 50; ++i) {
+            points.push_back(random_point(rng, 2));
+            index.insert(i, points.back().data());
+        }
+        BruteForceIndex reference(2);
+        for (size_t i = 0; i != 50; ++i)
+            reference.insert(i, points[i].data());
+        for (size_t i = 0; i != 50; ++i)
+            EXPECT_EQ(reference.nearest2(points[i].data()),
+                      index.nearest2(points[i].data()));
+        for (size_t i = 0; i != 50; ++i)
+            index.erase(i);
+        EXPECT_EQ(0, index.size());
+    }
+}
@@ -0,0 +1,111 @@
+#ifndef GPSOINN_SHARDED_HXX
+#define GPSOINN_SHARDED_HXX
+
+#include "thread_pool.hxx"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace GPSOINN {
+
+// Trains shards independent networks of type Net on separate threads, the
+// samples dealt out in turn, and merges them into one network with
+// Net::merge every merge_interval samples, 0 for merge() only. The shards
+// never see the merged network, so the result only depends on the seed,
+// the number of shards and the samples, not on the timing of the threads.
+// After a merge the shards start over from their seeds and the next merge
+// joins them into the merged network, so each merge only covers what was
+// learnt since the last one; settings made on shard() last until then.
+template <typename Net> class ShardedTrainer {
+  public:
+    // make(seed) builds one empty network
+    typedef std::function<std::unique_ptr<Net>(unsigned seed)> Factory;
+
+    ShardedTrainer(unsigned shards, const Factory &make, unsigned seed = 0,
+                   size_t merge_interval = 20000);
+
+    // Sample is what Net::train takes
+    template <typename Sample> void train(std::vector<Sample> &samples);
+    // merges now instead of at the next interval, if anything was trained
+    // since the last merge
+    void merge();
+
+    // the merged network, readers may use its published() snapshots
+    Net &network() noexcept { return *m_network; }
+    Net &shard(size_t index) noexcept { return *m_shards[index]; }
+    size_t shard_count() const noexcept { return m_shards.size(); }
+
+  private:
+    Factory m_make;
+    std::vector<uint32_t> m_seeds;
+    std::vector<std::unique_ptr<Net>> m_shards;
+    std::unique_ptr<Net> m_network;
+    bool m_merged = false;
+    ThreadPool m_pool;
+    size_t m_merge_interval;
+    size_t m_samples = 0;
+    size_t m_unmerged = 0;
+};
+
+} // namespace GPSOINN
+
+namespace GPSOINN {
+
+template <typename Net>
+ShardedTrainer<Net>::ShardedTrainer(unsigned shards, const Factory &make,
+                                    unsigned seed, size_t merge_interval)
+    : m_make(make), m_seeds(shards + 1), m_pool(shards),
+      m_merge_interval(merge_interval) {
+    // a seed per shard, and one for the merged network
+    std::seed_seq sequence{seed};
+    sequence.generate(m_seeds.begin(), m_seeds.end());
+    for (unsigned i = 0; i != shards; ++i)
+        m_shards.push_back(make(m_seeds[i]));
+    m_network = make(m_seeds[shards]);
+}
+
+template <typename Net>
+template <typename Sample>
+void ShardedTrainer<Net>::train(std::vector<Sample> &samples) {
+    size_t shards = m_shards.size();
+    size_t begin = 0;
+    while (begin != samples.size()) {
+        // up to the next merge, so merges do not depend on the batches
+        size_t end = samples.size();
+        if (m_merge_interval)
+            end = std::min(end, begin + m_merge_interval - m_unmerged);
+        m_pool.run(shards, [&](unsigned, size_t shard) {
+            size_t first = (shard + shards - m_samples % shards) % shards;
+            for (size_t i = begin + first; i < end; i += shards)
+                m_shards[shard]->train(samples[i]);
+        });
+        m_samples += end - begin;
+        m_unmerged += end - begin;
+        begin = end;
+        if (m_unmerged == m_merge_interval)
+            merge();
+    }
+}
+
+template <typename Net> void ShardedTrainer<Net>::merge() {
+    if (m_merged && !m_unmerged)
+        return;
+    std::vector<Net *> shards;
+    if (m_merged)
+        shards.push_back(m_network.get());
+    for (auto &shard : m_shards)
+        shards.push_back(shard.get());
+    m_network->merge(shards);
+    for (size_t i = 0; i != m_shards.size(); ++i)
+        m_shards[i] = m_make(m_seeds[i]);
+    m_merged = true;
+    m_unmerged = 0;
+}
+
+} // namespace GPSOINN
+
+#endif // GPSOINN_SHARDED_HXX
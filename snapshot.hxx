@@ -0,0 +1,179 @@
+#ifndef GPSOINN_SNAPSHOT_HXX
+#define GPSOINN_SNAPSHOT_HXX
+
+#include "mixture.hxx"
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace GPSOINN {
+
+// Snapshot file layout, in native byte order. The header is followed by
+// sections each starting at a multiple of snapshot_alignment:
+//   vectors     nodes * dimension doubles, one node after another
+//   win counts  nodes uint64
+//   edges       edges SnapshotEdge, both halves of an undirected edge
+//   mixture     GaussianMixture::data_size(dimension, components) doubles,
+//               absent when components is 0
+// Nodes are numbered densely in slot order.
+constexpr char snapshot_magic[8] = {'G', 'P', 'S', 'O', 'I', 'N', 'N', 0};
+constexpr uint32_t snapshot_version = 1;
+constexpr uint64_t snapshot_alignment = 64;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t dimension;
+    uint64_t nodes;
+    uint64_t edges;
+    uint64_t components;
+
+    // hyperparameters and training state
+    double sigma_2;
+    double weight_sum;
+    uint32_t lambda;
+    uint32_t age_max;
+    uint32_t k;
+    uint32_t local_opt_coeff;
+    uint32_t cycles;
+    uint32_t reserved;
+
+    // offsets from the start of the file
+    uint64_t vectors;
+    uint64_t win_counts;
+    uint64_t edge_list;
+    uint64_t mixture;
+    uint64_t file_size;
+};
+static_assert(sizeof(SnapshotHeader) % snapshot_alignment == 0,
+              "the header keeps the sections aligned");
+
+// ages seen from either end
+struct SnapshotEdge {
+    uint64_t v1;
+    uint64_t v2;
+    uint32_t age1;
+    uint32_t age2;
+};
+
+inline uint64_t snapshot_align(uint64_t offset) {
+    return (offset + snapshot_alignment - 1) / snapshot_alignment *
+           snapshot_alignment;
+}
+
+// fills in the offsets from the counts
+inline void snapshot_layout(SnapshotHeader &header) {
+    uint64_t offset = sizeof(SnapshotHeader);
+    header.vectors = offset;
+    offset = snapshot_align(offset +
+                            header.nodes * header.dimension * sizeof(double));
+    header.win_counts = offset;
+    offset = snapshot_align(offset + header.nodes * sizeof(uint64_t));
+    header.edge_list = offset;
+    offset = snapshot_align(offset + header.edges * sizeof(SnapshotEdge));
+    header.mixture = offset;
+    if (header.components)
+        offset += GaussianMixture<Eigen::Dynamic>::data_size(
+                      header.dimension, header.components) *
+                  sizeof(double);
+    header.file_size = offset;
+}
+
+// whether count * count2 items of bytes each fit in size bytes, without
+// multiplying past 2^64
+inline bool snapshot_fits(uint64_t size, uint64_t bytes, uint64_t count,
+                          uint64_t count2 = 1) {
+    return !count || !count2 ||
+           (count <= size / bytes && count2 <= size / bytes / count);
+}
+
+// throws unless header describes a snapshot of size bytes this version
+// reads
+inline void snapshot_check(const SnapshotHeader &header, uint64_t size) {
+    if (std::memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)))
+        throw std::runtime_error("not a GPSOINN snapshot");
+    if (header.version != snapshot_version ||
+        header.header_size != sizeof(SnapshotHeader))
+        throw std::runtime_error("unsupported snapshot version");
+    // training prunes when cycles reaches lambda, which it would not again
+    // until the counter wraps
+    if (!header.lambda || header.cycles >= header.lambda)
+        throw std::runtime_error("corrupt snapshot");
+
+    // every section fits in the file before the layout multiplies the
+    // counts out, and the file in 2^60 bytes, so no offset wraps around
+    uint64_t dimension = header.dimension;
+    if (size > std::numeric_limits<uint64_t>::max() / 16 ||
+        !snapshot_fits(size, sizeof(double), header.nodes, dimension) ||
+        !snapshot_fits(size, sizeof(uint64_t), header.nodes) ||
+        !snapshot_fits(size, sizeof(SnapshotEdge), header.edges) ||
+        !snapshot_fits(size, sizeof(double), header.components) ||
+        (header.components &&
+         (!snapshot_fits(size, sizeof(double), dimension, dimension) ||
+          !snapshot_fits(size, sizeof(double), dimension * dimension,
+                         header.components))))
+        throw std::runtime_error("corrupt snapshot");
+
+    SnapshotHeader expected = header;
+    snapshot_layout(expected);
+    if (std::memcmp(&expected, &header, sizeof(header)) ||
+        header.file_size != size)
+        throw std::runtime_error("corrupt snapshot");
+}
+
+// pads out to the next section
+inline void snapshot_pad(std::ostream &out, uint64_t offset) {
+    static const char zeros[snapshot_alignment] = {};
+    out.write(zeros, snapshot_align(offset) - offset);
+}
+
+// reads size bytes at offset, skipping the padding from position on
+inline void snapshot_read(std::istream &in, uint64_t &position, uint64_t offset,
+                          void *data, uint64_t size) {
+    in.ignore(offset - position);
+    if (!in.read(static_cast<char *>(data), size))
+        throw std::runtime_error("truncated snapshot");
+    position = offset + size;
+}
+
+// Reads count items at offset into items, growing them a chunk at a time,
+// so a count past the end of the stream runs out of data long before it
+// runs out of memory.
+template <typename T>
+void snapshot_read(std::istream &in, uint64_t &position, uint64_t offset,
+                   std::vector<T> &items, uint64_t count) {
+    constexpr uint64_t chunk = (uint64_t(1) << 20) / sizeof(T);
+    items.clear();
+    while (items.size() != count) {
+        size_t read = items.size();
+        items.resize(read + std::min(chunk, count - read));
+        snapshot_read(in, position, offset + read * sizeof(T),
+                      items.data() + read, (items.size() - read) * sizeof(T));
+    }
+}
+
+// the bytes from the position of in to its end, npos when it cannot seek
+inline uint64_t snapshot_remaining(std::istream &in) {
+    const uint64_t npos = -1;
+    auto position = in.tellg();
+    if (position == std::istream::pos_type(-1))
+        return npos;
+    auto end = in.seekg(0, std::ios::end).tellg();
+    in.clear();
+    in.seekg(position);
+    if (end == std::istream::pos_type(-1) || !in)
+        return npos;
+    return uint64_t(end - position);
+}
+
+} // namespace GPSOINN
+
+#endif // GPSOINN_SNAPSHOT_HXX
@@ -0,0 +1,122 @@
+#ifndef GPSOINN_THREAD_POOL_HXX
+#define GPSOINN_THREAD_POOL_HXX
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace GPSOINN {
+
+class ThreadPool {
+  public:
+    // 0 for one thread per hardware thread
+    explicit ThreadPool(unsigned threads = 0);
+    ThreadPool(const ThreadPool &other) = delete;
+    ThreadPool &operator=(const ThreadPool &other) = delete;
+    ~ThreadPool();
+
+    // the calling thread counts as one
+    unsigned size() const noexcept { return m_workers.size() + 1; }
+
+    // calls task(worker, index) for every index in [0, count), worker being
+    // in [0, size()); the calling thread joins in as worker 0 and the call
+    // returns when every task is done. Not reentrant.
+    template <typename Task> void run(size_t count, Task &&task);
+
+  private:
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::function<void(unsigned)> m_job;
+    size_t m_generation = 0;
+    size_t m_busy = 0;
+    bool m_stop = false;
+
+    void work(unsigned worker);
+};
+
+} // namespace GPSOINN
+
+namespace GPSOINN {
+
+inline ThreadPool::ThreadPool(unsigned threads) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 1; i != threads; ++i)
+        m_workers.emplace_back(&ThreadPool::work, this, i);
+}
+
+inline ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto &worker : m_workers)
+        worker.join();
+}
+
+inline void ThreadPool::work(unsigned worker) {
+    size_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock,
+                        [&] { return m_stop || m_generation != seen; });
+            if (m_stop)
+                return;
+            seen = m_generation;
+        }
+        m_job(worker);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_busy == 0)
+                m_done.notify_one();
+        }
+    }
+}
+
+template <typename Task> void ThreadPool::run(size_t count, Task &&task) {
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto job = [&](unsigned worker) {
+        try {
+            for (size_t index; (index = next++) < count;)
+                task(worker, index);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+            next = count;
+        }
+    };
+
+    if (m_workers.empty() || count < 2) {
+        job(0);
+    } else {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = job;
+            m_busy = m_workers.size();
+            ++m_generation;
+        }
+        m_wake.notify_all();
+        job(0);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [&] { return m_busy == 0; });
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+} // namespace GPSOINN
+
+#endif // GPSOINN_THREAD_POOL_HXX